@@ -0,0 +1,365 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "compress.h"
+
+// The encoder as it was before hash chains, kept to check the exact mode
+// against and to have a baseline to measure from.
+size_t compressReference(const std::vector<char>& inputBuffer, std::vector<char>& outputBuffer)
+{
+	uint32_t bitMask = 0x8000;
+	int searchWindow = CWINDOW_SIZE;
+	size_t size = inputBuffer.size() / sizeof(uint16_t);
+	const uint16_t* inp = reinterpret_cast<const uint16_t*>(inputBuffer.data());
+
+	outputBuffer.clear();
+	outputBuffer.resize((size + size / 16 + 2) * sizeof(uint16_t) + 2048);
+
+	uint16_t* outPtr = reinterpret_cast<uint16_t*>(outputBuffer.data());
+
+	const uint16_t* inPtr = inp;
+	const uint16_t* inEnd = inp + size;
+
+	uint16_t* flagWordPtr = outPtr++;
+	*flagWordPtr = 0;
+
+	while (inPtr < inEnd) {
+		if (bitMask == 0) {
+			flagWordPtr = outPtr++;
+			*flagWordPtr = 0;
+			bitMask = 0x8000;
+		}
+
+		const uint16_t* searchEnd = (inPtr - inp) > searchWindow ? (inPtr - searchWindow) : inp;
+
+		const uint16_t* bestMatch = nullptr;
+		uint32_t bestLength = 0;
+		const uint16_t* searchPtr = inPtr - 1;
+
+		while (searchPtr >= searchEnd) {
+			uint32_t length = 0;
+			while ((inPtr + length) < inEnd && length < CMATCH_MAX && searchPtr[length] == inPtr[length]) {
+				length++;
+			}
+			if (length > bestLength) {
+				bestLength = length;
+				bestMatch = searchPtr;
+			}
+			searchPtr--;
+		}
+
+		if (bestLength >= 2) {
+			uint32_t offset = inPtr - bestMatch;
+			*outPtr++ = (bestLength << 11) | offset;
+			inPtr += bestLength;
+			*flagWordPtr |= bitMask;
+		} else {
+			*outPtr++ = *inPtr++;
+		}
+		bitMask >>= 1;
+	}
+
+	if (bitMask != 0x8000) {
+		*flagWordPtr |= bitMask;
+	}
+
+	size_t outputSize = (reinterpret_cast<char*>(outPtr) - outputBuffer.data());
+
+	size_t align = (outputSize / 2048) * 2048;
+	if(align == 0 || align < outputSize)
+		align += 2048;
+
+	outputBuffer.resize(align);
+	return align;
+}
+
+// Synthetic inputs, roughly what ends up in the archives
+
+std::vector<char> makeRandom(size_t size, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::vector<char> data(size);
+	for(auto& c : data)
+		c = char(rng());
+	return data;
+}
+
+// DDS header followed by DXT1-ish blocks: a handful of recurring blocks
+// (flat colour, mip tails) mixed with noise, like most of the PC textures
+std::vector<char> makeDdsLike(size_t size, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::vector<char> data(size);
+	if(size >= 4)
+		memcpy(data.data(), "DDS ", 4);
+	std::vector<uint64_t> palette(32);
+	for(auto& p : palette)
+		p = (uint64_t(rng()) << 32) | rng();
+
+	for(size_t i = 128; i + 8 <= size; i += 8)
+	{
+		uint64_t block;
+		if(rng() % 4 != 0)
+			block = palette[rng() % palette.size()];
+		else
+			block = (uint64_t(rng()) << 32) | rng();
+		memcpy(data.data() + i, &block, 8);
+	}
+	return data;
+}
+
+// padded PTX/MOMO sections and mip tails: long zero gaps between data
+std::vector<char> makeZeroHeavy(size_t size, uint32_t seed)
+{
+	std::vector<char> data = makeDdsLike(size, seed);
+	for(size_t i = 0; i < size; i += 65536)
+		memset(data.data() + i + std::min<size_t>(size - i, 16384), 0, std::min<size_t>(size - i, 65536) - std::min<size_t>(size - i, 16384));
+	return data;
+}
+
+// the same few KiB over and over, like duplicated frames
+std::vector<char> makeRepetitive(size_t size, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::vector<char> unit = makeRandom((512 + rng() % 3000) & ~1, seed); // fits the window
+	std::vector<char> data(size);
+	for(size_t i = 0; i < size; i++)
+	{
+		data[i] = unit[i % unit.size()];
+		if(rng() % 4096 == 0)
+			data[i] ^= 0x5a;
+	}
+	return data;
+}
+
+struct synthetic
+{
+	const char* name;
+	std::vector<char> (*make)(size_t, uint32_t);
+};
+
+const synthetic synthetics[] = {
+	{"random", makeRandom},
+	{"zero-heavy", makeZeroHeavy},
+	{"dds-like", makeDdsLike},
+	{"repetitive", makeRepetitive},
+};
+
+struct benchMode
+{
+	const char* label;
+	compressOptions opts;
+};
+
+// every --level, plus the top one threaded
+std::vector<benchMode> benchModes()
+{
+	std::vector<benchMode> modes;
+	for(int level = 0; level <= CLEVEL_MAX; level++)
+	{
+		static const char* labels[] = {"level 0", "level 1", "level 2", "level 3"};
+		modes.push_back({labels[level], compressLevel(level)});
+	}
+	compressOptions threaded = compressLevel(CLEVEL_MAX);
+	threaded.threads = 4;
+	modes.push_back({"level 3 x4", threaded});
+	return modes;
+}
+
+std::vector<char> readFile(const char* path)
+{
+	std::ifstream f(path, std::ios::binary | std::ios::ate);
+	if(!f.is_open())
+		return {};
+	size_t fsize = f.tellg();
+	f.seekg(0, std::ios::beg);
+	std::vector<char> buff(fsize);
+	f.read(buff.data(), buff.size());
+	return buff;
+}
+
+// Decodes packed with both decoders and compares against input. The size
+// pre-pass has to agree with decompress(), and the streaming decoder has to
+// give the same words when read in odd-sized pieces.
+bool roundTrip(const std::vector<char>& input, const std::vector<char>& packed)
+{
+	const int16_t* in = reinterpret_cast<const int16_t*>(packed.data());
+	size_t words = input.size() / sizeof(int16_t);
+
+	size_t dsize = decompressedSize(in, packed.size());
+	if(dsize < words * sizeof(int16_t))
+		return false;
+	std::vector<int16_t> out(dsize / sizeof(int16_t));
+	if(decompress(in, out.data(), packed.size(), dsize) != dsize)
+		return false;
+	if(memcmp(out.data(), input.data(), words * sizeof(int16_t)) != 0)
+		return false;
+
+	decompressStream ds(in, packed.size());
+	std::vector<int16_t> piece(1021);
+	size_t pos = 0;
+	for(;;)
+	{
+		size_t n = ds.read(piece.data(), piece.size());
+		if(pos + n > out.size() || memcmp(piece.data(), out.data() + pos, n * sizeof(int16_t)) != 0)
+			return false;
+		pos += n;
+		if(n < piece.size())
+			break;
+	}
+	return !ds.failed && pos == out.size();
+}
+
+// compressStream fed in uneven pieces, has to give the same bytes as compress()
+std::vector<char> compressStreamed(const std::vector<char>& input, const compressOptions& opts, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::vector<char> out;
+	compressStream cs(opts, [&](const char* d, size_t n) { out.insert(out.end(), d, d + n); });
+	for(size_t pos = 0; pos < input.size();)
+	{
+		size_t n = std::min<size_t>(input.size() - pos, 1 + rng() % (rng() % 4 == 0 ? 1024 * 1024 : 4096));
+		cs.write(input.data() + pos, n);
+		pos += n;
+	}
+	if(cs.finish() != out.size())
+		out.clear();
+	return out;
+}
+
+template<typename F>
+double timeIt(F&& fn, int runs = 3)
+{
+	double best = 1e30;
+	for(int i = 0; i < runs; i++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+		best = std::min(best, d.count());
+	}
+	return best;
+}
+
+void benchInput(const char* name, const std::vector<char>& input, bool reference)
+{
+	printf("== %s (%lu bytes)\n", name, input.size());
+	double mb = input.size() / (1024.0 * 1024.0);
+
+	std::vector<char> ref;
+	if(reference)
+	{
+		double t = timeIt([&] { compressReference(input, ref); }, 1);
+		printf("   %-12s %9.2f MB/s  ratio %.3f\n", "brute-force", mb / t, double(ref.size()) / input.size());
+	}
+
+	for(const benchMode& m : benchModes())
+	{
+		std::vector<char> out;
+		double t = timeIt([&] { compress(input, out, m.opts); });
+
+		std::vector<int16_t> dec(decompressedSize(reinterpret_cast<const int16_t*>(out.data()), out.size()) / sizeof(int16_t) + 1);
+		double dt = timeIt([&] {
+			decompress(reinterpret_cast<const int16_t*>(out.data()), dec.data(), out.size(), dec.size() * sizeof(int16_t));
+		});
+
+		printf("   %-12s %9.2f MB/s  ratio %.3f  decode %9.2f MB/s  %s", m.label, mb / t, double(out.size()) / input.size(), mb / dt,
+			roundTrip(input, out) ? "round-trip ok" : "ROUND-TRIP FAILED");
+		if(reference && m.opts.chainDepth == 0 && !m.opts.fullFormat && !m.opts.store && m.opts.threads <= 1)
+			printf(", %s", out == ref ? "identical" : "MISMATCH");
+		printf("\n");
+	}
+}
+
+// Random inputs of random kinds and sizes through every mode, stops at the
+// first failure and prints what to reproduce it with
+int roundTripCheck(int count)
+{
+	std::mt19937 rng(12345);
+	std::vector<benchMode> modes = benchModes();
+	for(int i = 0; i < count; i++)
+	{
+		const synthetic& kind = synthetics[rng() % (sizeof(synthetics) / sizeof(synthetics[0]))];
+		size_t size = rng() % (rng() % 8 == 0 ? 2 * 1024 * 1024 : 64 * 1024);
+		uint32_t seed = rng();
+		std::vector<char> input = kind.make(size, seed);
+
+		for(const benchMode& m : modes)
+		{
+			std::vector<char> out;
+			compress(input, out, m.opts);
+			if(!roundTrip(input, out))
+			{
+				printf("-- FAILED: %s, size %lu, seed %u, mode \"%s\"\n", kind.name, size, seed, m.label);
+				return 1;
+			}
+			if(compressStreamed(input, m.opts, seed) != out)
+			{
+				printf("-- STREAM DIFFERS: %s, size %lu, seed %u, mode \"%s\"\n", kind.name, size, seed, m.label);
+				return 1;
+			}
+		}
+		if((i + 1) % 100 == 0)
+			printf("-- %d/%d\n", i + 1, count);
+	}
+	printf("-- %d inputs round-tripped in %lu modes\n", count, modes.size());
+	return 0;
+}
+
+void printHelp(const char* m)
+{
+	printf("Usage: %s [--no-reference] [files...]\n", m);
+	printf("       %s --roundtrip [count]\n\n", m);
+	printf("Without files runs on synthetic inputs (random, zero-heavy, dds-like, repetitive).\n");
+	printf("--no-reference skips the slow brute-force encoder.\n");
+}
+
+int main(int argc, char** argv)
+{
+	bool reference = true;
+	std::vector<const char*> files;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--roundtrip") == 0)
+			return roundTripCheck(i + 1 < argc ? atoi(argv[i + 1]) : 1000);
+		else if(strcmp(argv[i], "--no-reference") == 0)
+			reference = false;
+		else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+		{
+			printHelp(argv[0]);
+			return 0;
+		}
+		else
+			files.push_back(argv[i]);
+	}
+
+	if(!files.empty())
+	{
+		for(const char* path : files)
+		{
+			std::vector<char> data = readFile(path);
+			if(data.empty())
+			{
+				printf("-- Cannot read \"%s\"\n", path);
+				continue;
+			}
+			benchInput(path, data, reference);
+		}
+		return 0;
+	}
+
+	for(const synthetic& s : synthetics)
+	{
+		std::string name = std::string(s.name) + " 2 MiB";
+		benchInput(name.c_str(), s.make(2 * 1024 * 1024, 1), reference);
+	}
+	return 0;
+}
@@ -0,0 +1,744 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/*
+** ⠀⠀⠀⠀⢀⡴⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⡼⠃⣀⠀⠀⣄⡀⠀⠀⠰⠆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⣦⡀⠙⢷⣄⠀⠀⠀⠀⠀⢀⣀⣤⣴⣶⣾⣿⣿⣿⡿⠿⠷⢶⣾⣦⣐⠶⠤⠄⣀⣲⡀⠀⠀⠀⠀⠀⢻⡆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⢀⡖⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣰⡇⠀⡟⠀⠀⠈⢷⡀⠀⠀⠘⠶⣦⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠸⣿⣛⢶⣄⡙⢷⣤⣤⣴⣿⣿⣿⣿⣿⣿⣿⡟⠉⠀⠀⠀⠀⠈⣷⡈⠻⣧⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
+** ⠀⠀⣠⡟⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢿⣿⠇⢠⡇⠀⠀⠀⠈⣷⣄⠀⠀⠀⠘⢷⡀⠀⠀⠀⠀⠀⠀⠀⠀⠘⢻⡎⠛⢾⣿⣶⣿⣿⠟⠋⠙⠻⢿⡿⠿⠋⠀⠀⠀⠀⠀⠀⠀⣿⣷⣤⠈⠛⢧⣄⠀⠀⠀⠀⠀⠀⠀⠀⠘⢷⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
+** ⠀⢠⡿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⣷⣾⠃⠀⠀⠀⡀⢹⣿⣦⡀⠀⠀⠈⢻⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⢿⡄⢨⣿⡟⠉⠿⢿⣷⣤⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣿⢃⡿⠀⠀⠀⠉⠷⣄⠀⠀⠀⠀⠀⠀⠀⠀⠙⢷⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
+** ⢠⡿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⡼⢰⠀⠀⠻⣿⡿⡆⠀⠀⠀⡇⠀⢿⡏⠻⣆⠀⠀⠀⠹⣦⠀⠀⠀⠀⠀⠀⠀⠀⠈⣷⡈⠉⢿⡀⠀⠀⠈⠉⠉⠃⠀⠀⠀⠀⠀⠀⠀⠀⢠⣿⠋⣾⠃⠀⠀⠀⠀⠀⠙⣧⠀⠀⠀⠀⠀⠀⠀⠀⠀⠙⢷⣶⣄⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
+** ⣾⠃⠀⠀⠀⠀⠀⠀⠀⣶⡇⢸⡇⢸⡇⠀⠀⣻⣿⡖⠀⠀⢰⡇⠀⣸⣷⠀⠈⠳⣦⡀⠀⠈⢳⣄⠀⠀⠀⠀⠀⠀⠀⠘⢷⡀⠈⢷⣄⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⡴⠟⠁⣿⠃⠀⠀⠀⠀⠀⠀⠀⢸⡇⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠛⢯⡙⠳⣦⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀
+** ⡟⠀⠀⠀⠀⠀⠀⠀⠠⣿⡇⠀⠇⠸⠇⠀⠀⢸⣿⣷⠀⠀⡿⠀⠀⢸⣿⡄⠀⠀⠈⠻⣦⣄⡀⠙⢷⣄⠀⠀⠀⠀⠀⠀⠘⣧⠀⠀⠙⠿⣿⣷⣶⣦⣤⣶⠶⠚⠛⠛⠉⠀⣠⡾⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⣽⣦⡀⠙⠛⢶⣤⡀⠀⠀⠀⠀⠀
+** ⠁⠀⠀⠀⠀⠀⠀⠀⠀⣿⡇⠀⠀⠁⠀⠀⠀⢸⡏⢻⣇⣼⠃⠀⠀⠸⣿⡇⠀⣀⣤⣶⣤⣽⡿⠶⣤⣙⣷⣀⠀⠀⠀⠀⠀⠸⣧⠀⠀⠀⠈⠛⠛⠛⠛⠃⠀⠀⠀⣀⣤⠾⠋⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢻⣿⣿⣦⡀⠀⠈⠙⠳⢦⡀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⡇⠀⠀⠀⠀⠀⠀⢸⡇⠠⣿⣇⠀⠀⠀⠀⣿⣣⣶⣿⣿⡿⠛⠿⣄⠀⠀⠉⠛⠿⢶⣄⠀⠀⠀⠀⠙⣧⣀⣀⣀⣀⣀⣀⣀⣤⣤⠶⠞⠋⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢸⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⠻⣿⣿⣿⣦⣄⠀⠀⠀⠈⠒⠂
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠻⣿⠀⠀⠀⠀⠀⠀⣸⡇⠰⢿⣿⡄⠀⢀⣴⣿⣿⣿⡿⠋⠀⠀⠀⠙⢷⡄⠀⠀⠀⠀⠉⣿⠶⣤⣄⡀⠈⣯⡉⠉⠉⠉⠉⠉⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣹⡃⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⣿⣿⣿⣷⣄⠀⠀⠀⠀
+** ⠘⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⡀⠀⠀⠀⠀⠀⣾⡟⠁⠀⠻⣇⢰⣿⣿⣿⡿⠋⠀⠀⠀⠀⠀⠀⠈⣷⠀⠀⠀⠀⢰⡏⠀⠀⠈⠙⠛⠺⠷⣤⠀⠀⠀⢀⣄⣀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢸⣿⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣽⣿⣧⡝⠻⢦⣄⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⣧⠀⠀⠀⠀⣠⣿⡇⠀⠀⠀⣿⣿⣿⣿⣿⠀⠀⠀⠀⠀⠀⠀⠀⢀⣿⡆⠀⠀⢀⡿⠀⠀⠀⠀⠀⠀⠀⠀⣀⣀⣀⣴⠟⠛⠋⠛⢷⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣾⠇⠙⢷⡄⠀⠀⠀⠀⠀⠀⠀⠠⣤⡀⠀⠀⠈⠙⠻⣧⡄⠀⠉⠓⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢹⡇⠀⢀⣴⠏⢸⡇⠀⢀⣾⣿⣿⣿⡏⢻⠀⠀⠀⠀⠀⠀⠀⠀⣾⣿⡇⠀⢀⣾⠁⠀⠀⠀⠀⠀⢠⣶⠟⠿⠿⠋⠁⠀⠀⠀⠀⠘⣿⣷⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡏⠀⠀⠀⠻⣦⡀⠀⠀⠀⠀⠀⠀⠘⢿⡄⠀⠀⠀⠀⠘⢿⣦⡀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⣴⠟⠁⠀⢈⣧⠀⣿⣿⣿⣿⡿⠀⣿⠀⠀⠀⠀⠀⠀⢀⣾⣿⣿⠇⠀⣾⠁⠀⠀⠀⠀⠀⣀⣼⠏⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⠟⠹⣷⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣼⠃⠀⠀⠀⠐⢹⣷⡴⠀⠀⠀⠀⠀⠀⠈⣿⡄⠀⠀⠀⠀⠈⠻⣍⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡴⠛⢧⡀⠀⠀⠈⣿⣿⣿⣿⣿⡿⠁⢠⡏⠀⠀⠀⠀⠀⣠⣾⣿⡿⠃⢀⣼⠃⠀⠀⢀⣾⣿⡿⠛⠉⠀⠀⠀⠀⠀⠀⠀⢀⣴⠟⠁⠀⢀⣼⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⣰⡏⠀⠀⠀⠀⠀⠀⠘⢻⣄⠀⠀⠀⠀⠀⠀⢼⣿⣄⠀⠀⠀⠀⠀⠙⣧⡀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠀⠀⠘⢷⡀⠀⣴⣿⣿⠛⠋⠁⠀⠀⠸⠇⠀⠀⠀⠀⣸⣿⠟⠉⠀⣠⠞⠁⠀⠀⠀⠸⣿⣿⡄⠀⠀⠀⠀⠀⢀⣀⣤⡾⠛⠁⠀⣴⠟⠋⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡿⠀⠀⠀⠀⠀⠀⠀⠀⠀⣹⣦⠀⠀⠀⠀⠀⠀⣿⣿⢷⣄⠀⠀⠀⠀⠈⠻
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢿⣄⣹⣿⣿⣷⠀⠀⠀⠀⠀⠀⠀⢀⣰⣿⠿⠋⠀⣠⡾⠋⠀⠀⠀⠀⠀⠀⢹⣟⣁⣤⡶⠶⠞⠛⠛⠉⠁⠀⠀⠀⢠⡇⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⣿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠘⣷⡀⠀⠀⠀⠀⠀⢿⡄⠉⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⢰⡄⠀⠀⠀⠀⠀⠀⠀⠀⠙⣿⡁⢹⠈⢷⣀⠀⣀⣀⣤⡶⠟⠋⠁⢀⣤⠾⠋⠀⠀⠀⠀⠀⠀⠀⠀⣾⣿⠟⠁⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⡾⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡿⠙⠀⠀⢀⡀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢷⡀⠀⠀⠀⠀⠸⣇⠀⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⢿⡀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠻⣾⣇⠈⢿⣿⠟⠛⠁⠀⣠⣤⠾⠋⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⣷⠀⠀⠀⠀⠀⠀⢀⣠⠶⠛⠛⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣀⣤⡿⠷⠚⠛⠛⠛⠻⢷⣴⡀⠀⠀⠀⠀⠀⠀⠈⢻⡄⠀⠀⠀⠀⣿⠚⠛⠉⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠘⣧⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠛⠀⠀⠻⣆⠶⠞⠛⠉⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠛⠶⠶⠶⢿⣤⠴⠟⠁⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⡴⠖⠛⠋⠁⠀⠀⠀⠀⠀⠀⠀⠀⠈⠻⣶⡖⠀⢶⣦⠀⢀⣠⣴⠿⣆⠀⠀⠀⢿⡀⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠠⣤⡸⣦⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠹⣆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⣾⢟⡁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠙⢿⣷⡿⠳⠾⠛⠉⠀⠀⠹⣆⠀⠀⢸⡇⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠈⠙⢿⡆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⢧⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⠟⠁⠁⠈⠻⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠋⠀⠀⠀⠀⠀⠀⠀⠀⢻⡄⠀⠈⡇⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢻⡄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⢿⣦⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣰⡿⠁⠀⠀⠀⠀⠀⠈⠻⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⡀⠀⡇⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢷⡀⠀⠀⠀⠀⠀⠀⠀⢰⠀⠀⠀⠀⠀⠀⠀⢽⣧⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣴⠏⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠙⠢⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⣿⢷⠀⡇⠀⠀⠀⠀⠀⠀
+** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢧⠀⠀⠀⠀⠀⠀⠀⠈⠃⠀⠀⠀⠀⠀⠀⠀⠘⢷⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⣾⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⡀⠓⢀⣀⠀⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣼⠃⠘⣷⡇⠀⠀⠀⠀⠀⠀
+**
+**
+**  SOME BLACK MAGIC HAPPENING HERE ** 
+**************************************/
+
+#define CWINDOW_SIZE 2047 // 11 bit offset
+#define CMATCH_MAX 11 // longest match the game's own packer emits
+#define CLENGTH_INLINE 31 // 5 bit length field, 0 means "length in next word"
+#define CLENGTH_EXT 0x7FFF // older decoders read the length word as signed
+#define CHASH_BITS 16
+#define CCHUNK_WORDS (256 * 1024) // per-thread slice when compressing in parallel
+#define CLOOKAHEAD (CLENGTH_EXT + 2) // input a position's search can read past it
+#define CFLUSH_WORDS (64 * 1024) // packed words compressStream holds before handing them out
+
+struct compressOptions
+{
+	// candidates to try per position, 0 walks the whole window
+	// (output is then byte-identical to the old brute-force scan)
+	uint32_t chainDepth = 0;
+	// use the whole token set: long matches with an extended length word
+	// and zero runs (offset 0), plus an explicit end marker
+	bool fullFormat = false;
+	// stop looking for a better match once one is at least this long
+	uint32_t niceLength = 256;
+	// check the next position before taking a match (slower, smaller)
+	bool lazy = false;
+	// literal-only stream, no searching at all
+	bool store = false;
+	// above 1 the input is cut into CCHUNK_WORDS slices searched in parallel.
+	// Matches don't cross a slice end, so the output depends on whether this
+	// is on but not on the thread count.
+	uint32_t threads = 1;
+};
+
+#define CLEVEL_DEFAULT 2
+#define CLEVEL_MAX 3
+
+// --level presets, bench.cpp prints the speed and ratio of each
+//  0  store: literal-only stream at copy speed, for quick test cycles
+//  1  fast: short chains with the whole token set
+//  2  default: whole window, 11 word matches, same bytes as before
+//  3  max: whole token set, whole window, lazy matching
+inline compressOptions compressLevel(int level)
+{
+	compressOptions opts;
+	switch (level) {
+		case 0:
+			opts.store = true;
+			break;
+		case 1:
+			opts.fullFormat = true;
+			opts.chainDepth = 4;
+			opts.niceLength = 32;
+			break;
+		case 3:
+			opts.fullFormat = true;
+			opts.lazy = true;
+			opts.niceLength = CLENGTH_EXT;
+			break;
+		default:
+			break;
+	}
+	return opts;
+}
+
+// One literal or control word, ext holds the length for the extended form
+// (a control word with a zero length field)
+struct ctoken
+{
+	uint16_t word;
+	uint16_t ext;
+	bool match;
+};
+
+// Hash chains over adjacent word pairs. Every match worth emitting is at
+// least 2 words long, so only positions starting with the same pair can win.
+struct matchFinder
+{
+	std::vector<int32_t> head;
+	int32_t prev[CWINDOW_SIZE + 1];
+
+	matchFinder() : head(1 << CHASH_BITS, -1) {}
+
+	static uint32_t hash(const uint16_t* p)
+	{
+		uint32_t v = p[0] | (uint32_t(p[1]) << 16);
+		return (v * 2654435761u) >> (32 - CHASH_BITS);
+	}
+
+	void insert(const uint16_t* base, int32_t pos)
+	{
+		uint32_t h = hash(base + pos);
+		prev[pos & CWINDOW_SIZE] = head[h];
+		head[h] = pos;
+	}
+
+	// nearest longest match wins, same as scanning the window backwards
+	uint32_t find(const uint16_t* base, int32_t pos, uint32_t maxLength, uint32_t depth, int32_t& matchPos) const
+	{
+		const uint16_t* cur = base + pos;
+		uint32_t bestLength = 0;
+		int32_t cand = head[hash(cur)];
+		while (cand >= 0 && pos - cand <= CWINDOW_SIZE) {
+			const uint16_t* s = base + cand;
+			uint32_t length = 0;
+			while (length < maxLength && s[length] == cur[length])
+				length++;
+			if (length > bestLength) {
+				bestLength = length;
+				matchPos = cand;
+				if (length == maxLength) break;
+			}
+			if (depth != 0 && --depth == 0) break;
+			cand = prev[cand & CWINDOW_SIZE];
+		}
+		return bestLength;
+	}
+};
+
+// Match search over inp[begin, end). The previous window of input is used
+// as history, matches stop at end so slices can be searched independently.
+// Searching stops at the first token boundary at or after stop, which is
+// returned; with end at least CLOOKAHEAD past stop the tokens are the same
+// as a search that goes on.
+inline size_t findTokens(const uint16_t* inp, size_t size, size_t begin, size_t stop, size_t end, const compressOptions& opts, std::vector<ctoken>& tokens)
+{
+	matchFinder mf;
+	for (size_t pos = begin > CWINDOW_SIZE ? begin - CWINDOW_SIZE : 0; pos < begin; pos++)
+		mf.insert(inp, pos);
+
+	struct candidate
+	{
+		uint32_t zeroRun = 0;
+		uint32_t length = 0;
+		int32_t match = 0;
+
+		uint32_t best() const { return std::max(zeroRun, length); }
+	};
+
+	auto evaluate = [&](size_t pos) {
+		candidate c;
+		if (opts.fullFormat) {
+			size_t zeroEnd = std::min<size_t>(end, pos + CLENGTH_EXT);
+			while (pos + c.zeroRun < zeroEnd && inp[pos + c.zeroRun] == 0)
+				c.zeroRun++;
+		}
+		if (pos + 1 < end && c.zeroRun < opts.niceLength) {
+			uint32_t maxLength = std::min<size_t>(opts.fullFormat ? CLENGTH_EXT : CMATCH_MAX, end - pos);
+			if (opts.fullFormat)
+				maxLength = std::min(maxLength, std::max(opts.niceLength, c.zeroRun + 1));
+			c.length = mf.find(inp, pos, maxLength, opts.chainDepth, c.match);
+			// a nice match is usually the start of a long one
+			if (opts.fullFormat && c.length == maxLength) {
+				const uint16_t* s = inp + c.match;
+				uint32_t limit = std::min<size_t>(CLENGTH_EXT, end - pos);
+				while (c.length < limit && s[c.length] == inp[pos + c.length])
+					c.length++;
+			}
+		}
+		return c;
+	};
+
+	size_t pos = begin;
+	candidate next;
+	bool haveNext = false;
+	while (pos < stop) {
+		candidate c = haveNext ? next : evaluate(pos);
+		haveNext = false;
+		if (pos + 1 < size)
+			mf.insert(inp, pos);
+
+		// lazy matching: a literal now pays off if the next position has a
+		// longer match
+		if (opts.lazy && c.best() >= 2 && c.best() < opts.niceLength && pos + 1 < end) {
+			next = evaluate(pos + 1);
+			if (next.best() > c.best()) {
+				tokens.push_back({inp[pos], 0, false});
+				haveNext = true;
+				pos++;
+				continue;
+			}
+		}
+
+		size_t step = 1;
+		if (c.zeroRun >= 2 && c.zeroRun >= c.length) {
+			// offset 0 is a memset on the decoder side
+			if (c.zeroRun <= CLENGTH_INLINE)
+				tokens.push_back({uint16_t(c.zeroRun << 11), 0, true});
+			else
+				tokens.push_back({0, uint16_t(c.zeroRun), true});
+			step = c.zeroRun;
+		} else if (c.length >= 2) {
+			uint32_t offset = pos - c.match;
+			if (c.length <= CLENGTH_INLINE)
+				tokens.push_back({uint16_t((c.length << 11) | offset), 0, true});
+			else
+				tokens.push_back({uint16_t(offset), uint16_t(c.length), true});
+			step = c.length;
+		} else {
+			tokens.push_back({inp[pos], 0, false});
+		}
+
+		for (size_t tokenEnd = pos++ + step; pos < tokenEnd; pos++) {
+			if (pos + 1 < size)
+				mf.insert(inp, pos);
+		}
+	}
+	return pos;
+}
+
+inline void findTokens(const uint16_t* inp, size_t size, size_t begin, size_t end, const compressOptions& opts, std::vector<ctoken>& tokens)
+{
+	findTokens(inp, size, begin, end, end, opts, tokens);
+}
+
+// Serial stage: lays the tokens out in groups of 16 behind a flag word
+inline size_t packTokens(const std::vector<std::vector<ctoken>>& chunks, size_t size, const compressOptions& opts, std::vector<char>& outputBuffer)
+{
+	uint32_t bitMask = 0x8000;
+
+	// worst case is all literals plus one flag word per 16 of them
+	outputBuffer.clear();
+	outputBuffer.resize((size + size / 16 + 2) * sizeof(uint16_t) + 2048);
+
+	uint16_t* outPtr = reinterpret_cast<uint16_t*>(outputBuffer.data());
+
+	uint16_t* flagWordPtr = outPtr++;
+	*flagWordPtr = 0;
+
+	for (const std::vector<ctoken>& tokens : chunks) {
+		for (const ctoken& t : tokens) {
+			if (bitMask == 0) {
+				flagWordPtr = outPtr++;
+				*flagWordPtr = 0;
+				bitMask = 0x8000;
+			}
+			*outPtr++ = t.word;
+			if (t.match) {
+				*flagWordPtr |= bitMask;
+				if ((t.word >> 11) == 0)
+					*outPtr++ = t.ext;
+			}
+			bitMask >>= 1;
+		}
+	}
+
+	if (opts.fullFormat) {
+		// zero length zero run stops the decoder
+		if (bitMask == 0) {
+			flagWordPtr = outPtr++;
+			*flagWordPtr = 0;
+			bitMask = 0x8000;
+		}
+		*flagWordPtr |= bitMask;
+		*outPtr++ = 0;
+		*outPtr++ = 0;
+	} else if (bitMask != 0x8000) {
+		*flagWordPtr |= bitMask;
+	}
+
+	size_t outputSize = (reinterpret_cast<char*>(outPtr) - outputBuffer.data());
+
+	size_t align = (outputSize / 2048) * 2048;
+	if(align == 0 || align < outputSize)
+		align += 2048;
+
+	outputBuffer.resize(align);
+	return align;
+}
+
+// Literals only: a zero flag word in front of every 16 words, then the
+// end marker. Runs at copy speed.
+inline size_t storeLiterals(const uint16_t* inp, size_t size, std::vector<char>& outputBuffer)
+{
+	outputBuffer.clear();
+	outputBuffer.resize((size + size / 16 + 4) * sizeof(uint16_t) + 2048);
+	uint16_t* outPtr = reinterpret_cast<uint16_t*>(outputBuffer.data());
+
+	size_t pos = 0;
+	for (; pos + 16 <= size; pos += 16) {
+		*outPtr++ = 0;
+		std::memcpy(outPtr, inp + pos, 16 * sizeof(uint16_t));
+		outPtr += 16;
+	}
+	size_t rest = size - pos;
+	*outPtr++ = 0x8000 >> rest;
+	std::memcpy(outPtr, inp + pos, rest * sizeof(uint16_t));
+	outPtr += rest;
+	*outPtr++ = 0;
+	*outPtr++ = 0;
+
+	size_t outputSize = (reinterpret_cast<char*>(outPtr) - outputBuffer.data());
+	size_t align = (outputSize + 2047) & ~size_t(2047);
+	outputBuffer.resize(align);
+	return align;
+}
+
+inline size_t compress(const std::vector<char>& inputBuffer, std::vector<char>& outputBuffer, const compressOptions& opts = compressOptions())
+{
+	size_t size = inputBuffer.size() / sizeof(uint16_t);
+	const uint16_t* inp = reinterpret_cast<const uint16_t*>(inputBuffer.data());
+
+	if (opts.store)
+		return storeLiterals(inp, size, outputBuffer);
+
+	if (opts.threads <= 1 || size <= CCHUNK_WORDS) {
+		std::vector<std::vector<ctoken>> chunks(1);
+		chunks[0].reserve(size / 2);
+		findTokens(inp, size, 0, size, opts, chunks[0]);
+		return packTokens(chunks, size, opts, outputBuffer);
+	}
+
+	std::vector<std::vector<ctoken>> chunks((size + CCHUNK_WORDS - 1) / CCHUNK_WORDS);
+	std::atomic<size_t> next(0);
+	auto worker = [&] {
+		for (size_t i = next++; i < chunks.size(); i = next++) {
+			size_t begin = i * CCHUNK_WORDS;
+			size_t end = std::min<size_t>(size, begin + CCHUNK_WORDS);
+			chunks[i].reserve((end - begin) / 2);
+			findTokens(inp, size, begin, end, opts, chunks[i]);
+		}
+	};
+
+	std::vector<std::thread> pool;
+	size_t count = std::min<size_t>(opts.threads, chunks.size());
+	for (size_t i = 1; i < count; i++)
+		pool.emplace_back(worker);
+	worker();
+	for (std::thread& t : pool)
+		t.join();
+
+	return packTokens(chunks, size, opts, outputBuffer);
+}
+
+// Push-based encoder, same output as compress() with the same options.
+// Input is searched a slice at a time as it arrives and packed words go to
+// sink as groups fill up, so neither side is ever held whole. Keeps the last
+// window of input plus CLOOKAHEAD words, or a slice per thread when threaded.
+struct compressStream
+{
+	typedef std::function<void(const char*, size_t)> sinkFn;
+
+	compressStream(const compressOptions& o, sinkFn s) : opts(o), sink(std::move(s))
+	{
+		pending.push_back(0);
+	}
+
+	void write(const char* data, size_t n)
+	{
+		if (n == 0) return;
+		if (odd) {
+			char w[2] = {oddByte, *data++};
+			n--;
+			buf.push_back(0);
+			std::memcpy(&buf.back(), w, 2);
+			odd = false;
+		}
+		size_t words = n / sizeof(uint16_t);
+		size_t at = buf.size();
+		buf.resize(at + words);
+		std::memcpy(buf.data() + at, data, words * sizeof(uint16_t));
+		if (n % 2) {
+			odd = true;
+			oddByte = data[n - 1];
+		}
+		search(false);
+	}
+
+	// Ends the stream (a trailing odd byte is dropped like compress() does)
+	// and returns the packed size including the 2048 byte padding
+	size_t finish()
+	{
+		search(true);
+		if (opts.fullFormat || opts.store) {
+			// zero length zero run stops the decoder
+			if (bitMask == 0)
+				newGroup();
+			pending[flagPos] |= bitMask;
+			pending.push_back(0);
+			pending.push_back(0);
+		} else if (bitMask != 0x8000) {
+			pending[flagPos] |= bitMask;
+		}
+		flush();
+
+		size_t align = (written + 2047) & ~size_t(2047);
+		std::vector<char> zeros(align - written);
+		if (!zeros.empty())
+			sink(zeros.data(), zeros.size());
+		return written = align;
+	}
+
+private:
+	compressOptions opts;
+	sinkFn sink;
+	std::vector<uint16_t> buf; // history window + unsearched input
+	size_t base = 0; // input word buf[0] holds
+	size_t done = 0; // input words already turned into tokens
+	bool odd = false;
+	char oddByte = 0;
+	std::vector<uint16_t> pending; // packed words not handed out yet
+	size_t flagPos = 0;
+	uint32_t bitMask = 0x8000;
+	size_t written = 0;
+	std::vector<ctoken> tokens;
+
+	void search(bool final)
+	{
+		size_t avail = base + buf.size();
+		const uint16_t* inp = buf.data();
+
+		if (opts.store) {
+			for (size_t pos = done - base; pos < buf.size(); pos++)
+				put({inp[pos], 0, false});
+			done = avail;
+		} else if (opts.threads > 1) {
+			// whole slices at the same offsets compress() cuts them
+			size_t batch = size_t(opts.threads) * CCHUNK_WORDS;
+			while (done < avail && (final || avail - done >= batch)) {
+				size_t count = std::min<size_t>(opts.threads, (avail - done + CCHUNK_WORDS - 1) / CCHUNK_WORDS);
+				std::vector<std::vector<ctoken>> chunks(count);
+				std::atomic<size_t> next(0);
+				auto worker = [&] {
+					for (size_t i = next++; i < count; i = next++) {
+						size_t begin = done - base + i * CCHUNK_WORDS;
+						size_t end = std::min<size_t>(buf.size(), begin + CCHUNK_WORDS);
+						chunks[i].reserve((end - begin) / 2);
+						findTokens(inp, buf.size(), begin, end, opts, chunks[i]);
+					}
+				};
+				std::vector<std::thread> pool;
+				for (size_t i = 1; i < count; i++)
+					pool.emplace_back(worker);
+				worker();
+				for (std::thread& t : pool)
+					t.join();
+				for (const std::vector<ctoken>& chunk : chunks)
+					for (const ctoken& t : chunk)
+						put(t);
+				done = std::min(avail, done + count * CCHUNK_WORDS);
+			}
+		} else {
+			while (done < avail && (final || avail - done >= CCHUNK_WORDS + CLOOKAHEAD)) {
+				size_t stop = final ? avail : done + CCHUNK_WORDS;
+				tokens.clear();
+				done = base + findTokens(inp, buf.size(), done - base, stop - base, buf.size(), opts, tokens);
+				for (const ctoken& t : tokens)
+					put(t);
+			}
+		}
+
+		// keep a window behind the next position
+		size_t keep = done > base + CWINDOW_SIZE ? done - CWINDOW_SIZE - base : 0;
+		if (keep) {
+			buf.erase(buf.begin(), buf.begin() + keep);
+			base += keep;
+		}
+	}
+
+	void newGroup()
+	{
+		if (pending.size() >= CFLUSH_WORDS)
+			flush();
+		flagPos = pending.size();
+		pending.push_back(0);
+		bitMask = 0x8000;
+	}
+
+	void put(const ctoken& t)
+	{
+		if (bitMask == 0)
+			newGroup();
+		pending.push_back(t.word);
+		if (t.match) {
+			pending[flagPos] |= bitMask;
+			if ((t.word >> 11) == 0)
+				pending.push_back(t.ext);
+		}
+		bitMask >>= 1;
+	}
+
+	// only called between groups (or at the end), a flag word is never
+	// handed out before its tokens are known
+	void flush()
+	{
+		if (pending.empty()) return;
+		sink(reinterpret_cast<const char*>(pending.data()), pending.size() * sizeof(uint16_t));
+		written += pending.size() * sizeof(uint16_t);
+		pending.clear();
+		flagPos = 0;
+	}
+};
+
+#define DCOPY_WIDE 8 // words per 16 byte chunk
+#define DSIZE_LIMIT (size_t(1) << 32) // nothing in the game comes close
+
+// Copies a back-reference. With the source at least one chunk behind the
+// destination each 16 byte move can't read what it writes, so it is done in
+// wide chunks; closer offsets repeat a short pattern and go word by word.
+inline void copyMatch(int16_t* outPtr, uint32_t offset, uint32_t length)
+{
+	const int16_t* copySrc = outPtr - offset;
+	if (offset >= DCOPY_WIDE) {
+		while (length >= DCOPY_WIDE) {
+			std::memcpy(outPtr, copySrc, DCOPY_WIDE * sizeof(int16_t));
+			outPtr += DCOPY_WIDE;
+			copySrc += DCOPY_WIDE;
+			length -= DCOPY_WIDE;
+		}
+	} else if (offset == 1) {
+		std::fill(outPtr, outPtr + length, *copySrc);
+		return;
+	}
+	for (uint32_t i = 0; i < length; i++)
+		outPtr[i] = copySrc[i];
+}
+
+// size and capacity are in bytes. Returns the decompressed size, or 0 when
+// the stream is corrupt: a back-reference before the start of the output
+// or any write past capacity.
+inline size_t decompress(const int16_t* inputBuffer, int16_t* outputBuffer, size_t size, size_t capacity)
+{
+	uint32_t bitBuffer = 0;
+	uint32_t bitMask = 0;
+	const int16_t* inpPtr = inputBuffer;
+	const int16_t* inpEnd = inputBuffer + size / sizeof(int16_t);
+	int16_t* outPtr = outputBuffer;
+	int16_t* outEnd = outputBuffer + capacity / sizeof(int16_t);
+
+	while (inpPtr < inpEnd) {
+		if (bitMask == 0) {
+			bitBuffer = uint16_t(*inpPtr);
+			bitMask = 0x8000;
+			inpPtr++;
+		}
+
+		if (inpPtr >= inpEnd) break;
+
+		if ((bitMask & bitBuffer) == 0) {
+			if (outPtr >= outEnd) return 0;
+			*outPtr++ = *inpPtr++;
+		} else {
+			uint16_t controlWord = *inpPtr++;
+			uint32_t offset = controlWord & 0x7FF;
+			uint32_t length = controlWord >> 11;  // 0xB
+
+			if (length == 0) {
+				if (inpPtr >= inpEnd) break;
+				length = uint16_t(*inpPtr);
+				inpPtr++;
+			}
+
+			if (offset == 0 && length == 0) break;
+			if (length > size_t(outEnd - outPtr)) return 0;
+
+			if (offset == 0) {
+				std::memset(outPtr, 0, length * sizeof(int16_t));
+			} else {
+				if (offset > size_t(outPtr - outputBuffer)) return 0;
+				copyMatch(outPtr, offset, length);
+			}
+			outPtr += length;
+		}
+
+		bitMask >>= 1;
+	}
+	return (outPtr - outputBuffer) * sizeof(int16_t);
+}
+
+// Walks the tokens without writing anything and returns how many bytes
+// decompress() will produce, so callers can allocate exactly that much.
+// 0 for a corrupt stream or one that would expand past limit.
+inline size_t decompressedSize(const int16_t* inputBuffer, size_t size, size_t limit = DSIZE_LIMIT)
+{
+	uint32_t bitBuffer = 0;
+	uint32_t bitMask = 0;
+	const int16_t* inpPtr = inputBuffer;
+	const int16_t* inpEnd = inputBuffer + size / sizeof(int16_t);
+	size_t words = 0;
+	limit /= sizeof(int16_t);
+
+	while (inpPtr < inpEnd) {
+		if (bitMask == 0) {
+			bitBuffer = uint16_t(*inpPtr);
+			bitMask = 0x8000;
+			inpPtr++;
+		}
+
+		if (inpPtr >= inpEnd) break;
+
+		if ((bitMask & bitBuffer) == 0) {
+			inpPtr++;
+			words++;
+		} else {
+			uint16_t controlWord = *inpPtr++;
+			uint32_t offset = controlWord & 0x7FF;
+			uint32_t length = controlWord >> 11;
+
+			if (length == 0) {
+				if (inpPtr >= inpEnd) break;
+				length = uint16_t(*inpPtr);
+				inpPtr++;
+			}
+
+			if (offset == 0 && length == 0) break;
+			if (offset > words) return 0;
+			words += length;
+		}
+		if (words > limit) return 0;
+
+		bitMask >>= 1;
+	}
+	return words * sizeof(int16_t);
+}
+
+
+// Pull-based decoder. Keeps the flag word, a half-finished token and the
+// last window of output between calls, so the caller can take the output in
+// pieces of any size without holding all of it.
+struct decompressStream
+{
+	const int16_t* inpPtr;
+	const int16_t* inpEnd;
+	uint32_t bitBuffer = 0;
+	uint32_t bitMask = 0;
+	uint32_t pendingOffset = 0; // 0 with a length left is a zero run
+	uint32_t pendingLength = 0;
+	size_t produced = 0; // words so far
+	bool done = false;
+	bool failed = false;
+	int16_t window[CWINDOW_SIZE + 1];
+
+	decompressStream(const int16_t* inputBuffer, size_t size)
+		: inpPtr(inputBuffer), inpEnd(inputBuffer + size / sizeof(int16_t)) {}
+
+	void put(int16_t*& outPtr, int16_t w)
+	{
+		window[produced & CWINDOW_SIZE] = w;
+		produced++;
+		*outPtr++ = w;
+	}
+
+	// Writes up to words words, returns how many. Fewer than asked means the
+	// stream ended (check failed for a corrupt one).
+	size_t read(int16_t* outputBuffer, size_t words)
+	{
+		int16_t* outPtr = outputBuffer;
+		int16_t* outEnd = outputBuffer + words;
+
+		while (outPtr < outEnd) {
+			if (pendingLength != 0) {
+				size_t n = std::min<size_t>(pendingLength, outEnd - outPtr);
+				pendingLength -= n;
+				if (pendingOffset == 0) {
+					while (n--)
+						put(outPtr, 0);
+				} else {
+					while (n--)
+						put(outPtr, window[(produced - pendingOffset) & CWINDOW_SIZE]);
+				}
+				continue;
+			}
+
+			if (done || inpPtr >= inpEnd) {
+				done = true;
+				break;
+			}
+
+			if (bitMask == 0) {
+				bitBuffer = uint16_t(*inpPtr);
+				bitMask = 0x8000;
+				inpPtr++;
+				if (inpPtr >= inpEnd) {
+					done = true;
+					break;
+				}
+			}
+
+			if ((bitMask & bitBuffer) == 0) {
+				put(outPtr, *inpPtr++);
+			} else {
+				uint16_t controlWord = *inpPtr++;
+				uint32_t offset = controlWord & 0x7FF;
+				uint32_t length = controlWord >> 11;
+
+				if (length == 0) {
+					if (inpPtr >= inpEnd) {
+						done = true;
+						break;
+					}
+					length = uint16_t(*inpPtr);
+					inpPtr++;
+				}
+
+				if ((offset == 0 && length == 0) || offset > produced) {
+					failed = offset > produced;
+					done = true;
+					break;
+				}
+				pendingOffset = offset;
+				pendingLength = length;
+			}
+
+			bitMask >>= 1;
+		}
+		return outPtr - outputBuffer;
+	}
+};
@@ -0,0 +1,71 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "compress.h"
+
+#define FUZZ_SIZE_LIMIT (64 * 1024 * 1024)
+
+// Arbitrary bytes as a compressed stream. The decoders must not touch
+// memory outside their buffers (the sanitizers catch that) and have to agree
+// with each other on whatever they do produce.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	std::vector<int16_t> in((size + 1) / sizeof(int16_t));
+	if(size)
+		memcpy(in.data(), data, size);
+
+	size_t dsize = decompressedSize(in.data(), size, FUZZ_SIZE_LIMIT);
+	if(dsize == 0)
+		return 0;
+
+	std::vector<int16_t> out(dsize / sizeof(int16_t));
+	if(decompress(in.data(), out.data(), size, dsize) != dsize)
+		abort();
+
+	// one word short has to be refused, not overrun
+	if(decompress(in.data(), out.data(), size, dsize - sizeof(int16_t)) != 0)
+		abort();
+
+	decompressStream ds(in.data(), size);
+	std::vector<int16_t> piece(777);
+	size_t pos = 0;
+	for(;;)
+	{
+		size_t n = ds.read(piece.data(), piece.size());
+		if(pos + n > out.size() || memcmp(piece.data(), out.data() + pos, n * sizeof(int16_t)) != 0)
+			abort();
+		pos += n;
+		if(n < piece.size())
+			break;
+	}
+	if(ds.failed || pos != out.size())
+		abort();
+	return 0;
+}
+
+#ifdef FUZZ_MAIN
+// Replays inputs without libFuzzer, e.g. crash files or a corpus
+int main(int argc, char** argv)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		std::ifstream f(argv[i], std::ios::binary | std::ios::ate);
+		if(!f.is_open())
+		{
+			printf("-- Cannot read \"%s\"\n", argv[i]);
+			continue;
+		}
+		size_t fsize = f.tellg();
+		f.seekg(0, std::ios::beg);
+		std::vector<uint8_t> buff(fsize);
+		f.read(reinterpret_cast<char*>(buff.data()), buff.size());
+		LLVMFuzzerTestOneInput(buff.data(), buff.size());
+		printf("-- %s: ok\n", argv[i]);
+	}
+	return 0;
+}
+#endif
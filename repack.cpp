@@ -1,24 +1,56 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <ios>
 #include <iosfwd>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-#define DBUFFER_SIZE 8 * 1024 * 1024 // 8 MiB for now
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "compress.h"
+
+#define INDEX_NAME ".repack.idx" // see gameIndex
+#define JOBS_MAX 1024
 
 void printErr(const char* format, ...)
 {
@@ -32,7 +64,23 @@ void printErr(const char* format, ...)
 
 void printHelp(const char* m)
 {
-	printf("Usage: %s <filename> [-e | -p]\n\t-e | --extract (default)\n\t-p | --pack\n\n", m);
+	printf("Usage: %s <filename>... [-e | -p] [options]\n\t-e | --extract (default)\n\t-p | --pack\n\n", m);
+	printf("Inputs can be files, directories (searched recursively), wildcards (*, ?)\nand @list files with one input per line.\n\n");
+	printf("Options:\n\t-j | --jobs <n>\tthreads for extracting entries and compressing (0 = all cores)\n");
+	printf("\t--level <0-%d>\tcompression level for _compressed entries (default %d)\n", CLEVEL_MAX, CLEVEL_DEFAULT);
+	printf("\t\t\t0 store, 1 fast, 2 same as the game's files, 3 smallest\n");
+	printf("\t--mmap\t\tmemory-map the input instead of reading it when extracting\n");
+	printf("\t-i | --incremental\tonly rebuild what changed since extracting\n");
+	printf("\t-d | --dedup\tstore identical MOMO entries once when packing\n");
+	printf("\t-l | --list\tlist archives and their entries without extracting\n");
+	printf("\t--json\t\tlist as JSON\n");
+	printf("\t-x <archive> <entry>\textract one entry, e.g. id3/id1/id0.tm2, nothing else\n");
+	printf("\t-o <file>\twhere -x writes it (- for stdout)\n");
+	printf("\t--dds\t\twith -x, write the texture of a TIM2 entry\n");
+	printf("\t--patch <entry> <file>\treplace one entry of a MOMO (id3.tm2, id3 or 3), in place when it fits\n");
+	printf("\nIndex: %s index <dir> [--find <path>]...\n", m);
+	printf("\twrites <dir>/%s with every entry under dir, --find looks entries up in it\n", INDEX_NAME);
+	printf("\t(paths like pl.bin/id1.ptx/id0.tm2), rebuilding it when files changed or were added\n\n");
 }
 
 void printUsageError(const char* m, const char* arg)
@@ -41,717 +89,1335 @@ void printUsageError(const char* m, const char* arg)
 	printHelp(m);
 }
 
-void pack(const char*);
-
-/*
-** ⠀⠀⠀⠀⢀⡴⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⡼⠃⣀⠀⠀⣄⡀⠀⠀⠰⠆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⣦⡀⠙⢷⣄⠀⠀⠀⠀⠀⢀⣀⣤⣴⣶⣾⣿⣿⣿⡿⠿⠷⢶⣾⣦⣐⠶⠤⠄⣀⣲⡀⠀⠀⠀⠀⠀⢻⡆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⢀⡖⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣰⡇⠀⡟⠀⠀⠈⢷⡀⠀⠀⠘⠶⣦⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠸⣿⣛⢶⣄⡙⢷⣤⣤⣴⣿⣿⣿⣿⣿⣿⣿⡟⠉⠀⠀⠀⠀⠈⣷⡈⠻⣧⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
-** ⠀⠀⣠⡟⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢿⣿⠇⢠⡇⠀⠀⠀⠈⣷⣄⠀⠀⠀⠘⢷⡀⠀⠀⠀⠀⠀⠀⠀⠀⠘⢻⡎⠛⢾⣿⣶⣿⣿⠟⠋⠙⠻⢿⡿⠿⠋⠀⠀⠀⠀⠀⠀⠀⣿⣷⣤⠈⠛⢧⣄⠀⠀⠀⠀⠀⠀⠀⠀⠘⢷⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
-** ⠀⢠⡿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⣷⣾⠃⠀⠀⠀⡀⢹⣿⣦⡀⠀⠀⠈⢻⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⢿⡄⢨⣿⡟⠉⠿⢿⣷⣤⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣿⢃⡿⠀⠀⠀⠉⠷⣄⠀⠀⠀⠀⠀⠀⠀⠀⠙⢷⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
-** ⢠⡿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⡼⢰⠀⠀⠻⣿⡿⡆⠀⠀⠀⡇⠀⢿⡏⠻⣆⠀⠀⠀⠹⣦⠀⠀⠀⠀⠀⠀⠀⠀⠈⣷⡈⠉⢿⡀⠀⠀⠈⠉⠉⠃⠀⠀⠀⠀⠀⠀⠀⠀⢠⣿⠋⣾⠃⠀⠀⠀⠀⠀⠙⣧⠀⠀⠀⠀⠀⠀⠀⠀⠀⠙⢷⣶⣄⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀
-** ⣾⠃⠀⠀⠀⠀⠀⠀⠀⣶⡇⢸⡇⢸⡇⠀⠀⣻⣿⡖⠀⠀⢰⡇⠀⣸⣷⠀⠈⠳⣦⡀⠀⠈⢳⣄⠀⠀⠀⠀⠀⠀⠀⠘⢷⡀⠈⢷⣄⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⡴⠟⠁⣿⠃⠀⠀⠀⠀⠀⠀⠀⢸⡇⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠛⢯⡙⠳⣦⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀
-** ⡟⠀⠀⠀⠀⠀⠀⠀⠠⣿⡇⠀⠇⠸⠇⠀⠀⢸⣿⣷⠀⠀⡿⠀⠀⢸⣿⡄⠀⠀⠈⠻⣦⣄⡀⠙⢷⣄⠀⠀⠀⠀⠀⠀⠘⣧⠀⠀⠙⠿⣿⣷⣶⣦⣤⣶⠶⠚⠛⠛⠉⠀⣠⡾⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⣽⣦⡀⠙⠛⢶⣤⡀⠀⠀⠀⠀⠀
-** ⠁⠀⠀⠀⠀⠀⠀⠀⠀⣿⡇⠀⠀⠁⠀⠀⠀⢸⡏⢻⣇⣼⠃⠀⠀⠸⣿⡇⠀⣀⣤⣶⣤⣽⡿⠶⣤⣙⣷⣀⠀⠀⠀⠀⠀⠸⣧⠀⠀⠀⠈⠛⠛⠛⠛⠃⠀⠀⠀⣀⣤⠾⠋⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢻⣿⣿⣦⡀⠀⠈⠙⠳⢦⡀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⡇⠀⠀⠀⠀⠀⠀⢸⡇⠠⣿⣇⠀⠀⠀⠀⣿⣣⣶⣿⣿⡿⠛⠿⣄⠀⠀⠉⠛⠿⢶⣄⠀⠀⠀⠀⠙⣧⣀⣀⣀⣀⣀⣀⣀⣤⣤⠶⠞⠋⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢸⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⠻⣿⣿⣿⣦⣄⠀⠀⠀⠈⠒⠂
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠻⣿⠀⠀⠀⠀⠀⠀⣸⡇⠰⢿⣿⡄⠀⢀⣴⣿⣿⣿⡿⠋⠀⠀⠀⠙⢷⡄⠀⠀⠀⠀⠉⣿⠶⣤⣄⡀⠈⣯⡉⠉⠉⠉⠉⠉⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣹⡃⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⣿⣿⣿⣿⣷⣄⠀⠀⠀⠀
-** ⠘⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⡀⠀⠀⠀⠀⠀⣾⡟⠁⠀⠻⣇⢰⣿⣿⣿⡿⠋⠀⠀⠀⠀⠀⠀⠈⣷⠀⠀⠀⠀⢰⡏⠀⠀⠈⠙⠛⠺⠷⣤⠀⠀⠀⢀⣄⣀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢸⣿⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣽⣿⣧⡝⠻⢦⣄⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⣧⠀⠀⠀⠀⣠⣿⡇⠀⠀⠀⣿⣿⣿⣿⣿⠀⠀⠀⠀⠀⠀⠀⠀⢀⣿⡆⠀⠀⢀⡿⠀⠀⠀⠀⠀⠀⠀⠀⣀⣀⣀⣴⠟⠛⠋⠛⢷⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣾⠇⠙⢷⡄⠀⠀⠀⠀⠀⠀⠀⠠⣤⡀⠀⠀⠈⠙⠻⣧⡄⠀⠉⠓⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢹⡇⠀⢀⣴⠏⢸⡇⠀⢀⣾⣿⣿⣿⡏⢻⠀⠀⠀⠀⠀⠀⠀⠀⣾⣿⡇⠀⢀⣾⠁⠀⠀⠀⠀⠀⢠⣶⠟⠿⠿⠋⠁⠀⠀⠀⠀⠘⣿⣷⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡏⠀⠀⠀⠻⣦⡀⠀⠀⠀⠀⠀⠀⠘⢿⡄⠀⠀⠀⠀⠘⢿⣦⡀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⣴⠟⠁⠀⢈⣧⠀⣿⣿⣿⣿⡿⠀⣿⠀⠀⠀⠀⠀⠀⢀⣾⣿⣿⠇⠀⣾⠁⠀⠀⠀⠀⠀⣀⣼⠏⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⠟⠹⣷⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣼⠃⠀⠀⠀⠐⢹⣷⡴⠀⠀⠀⠀⠀⠀⠈⣿⡄⠀⠀⠀⠀⠈⠻⣍⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡴⠛⢧⡀⠀⠀⠈⣿⣿⣿⣿⣿⡿⠁⢠⡏⠀⠀⠀⠀⠀⣠⣾⣿⡿⠃⢀⣼⠃⠀⠀⢀⣾⣿⡿⠛⠉⠀⠀⠀⠀⠀⠀⠀⢀⣴⠟⠁⠀⢀⣼⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⣰⡏⠀⠀⠀⠀⠀⠀⠘⢻⣄⠀⠀⠀⠀⠀⠀⢼⣿⣄⠀⠀⠀⠀⠀⠙⣧⡀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠀⠀⠘⢷⡀⠀⣴⣿⣿⠛⠋⠁⠀⠀⠸⠇⠀⠀⠀⠀⣸⣿⠟⠉⠀⣠⠞⠁⠀⠀⠀⠸⣿⣿⡄⠀⠀⠀⠀⠀⢀⣀⣤⡾⠛⠁⠀⣴⠟⠋⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡿⠀⠀⠀⠀⠀⠀⠀⠀⠀⣹⣦⠀⠀⠀⠀⠀⠀⣿⣿⢷⣄⠀⠀⠀⠀⠈⠻
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢿⣄⣹⣿⣿⣷⠀⠀⠀⠀⠀⠀⠀⢀⣰⣿⠿⠋⠀⣠⡾⠋⠀⠀⠀⠀⠀⠀⢹⣟⣁⣤⡶⠶⠞⠛⠛⠉⠁⠀⠀⠀⢠⡇⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⣿⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠘⣷⡀⠀⠀⠀⠀⠀⢿⡄⠉⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⢰⡄⠀⠀⠀⠀⠀⠀⠀⠀⠙⣿⡁⢹⠈⢷⣀⠀⣀⣀⣤⡶⠟⠋⠁⢀⣤⠾⠋⠀⠀⠀⠀⠀⠀⠀⠀⣾⣿⠟⠁⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⡾⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⡿⠙⠀⠀⢀⡀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢷⡀⠀⠀⠀⠀⠸⣇⠀⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⢿⡀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠻⣾⣇⠈⢿⣿⠟⠛⠁⠀⣠⣤⠾⠋⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢻⣷⠀⠀⠀⠀⠀⠀⢀⣠⠶⠛⠛⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣀⣤⡿⠷⠚⠛⠛⠛⠻⢷⣴⡀⠀⠀⠀⠀⠀⠀⠈⢻⡄⠀⠀⠀⠀⣿⠚⠛⠉⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠘⣧⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠛⠀⠀⠻⣆⠶⠞⠛⠉⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠛⠶⠶⠶⢿⣤⠴⠟⠁⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⡴⠖⠛⠋⠁⠀⠀⠀⠀⠀⠀⠀⠀⠈⠻⣶⡖⠀⢶⣦⠀⢀⣠⣴⠿⣆⠀⠀⠀⢿⡀⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠠⣤⡸⣦⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠹⣆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⣾⢟⡁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠙⢿⣷⡿⠳⠾⠛⠉⠀⠀⠹⣆⠀⠀⢸⡇⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠈⠙⢿⡆⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⢧⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⠟⠁⠁⠈⠻⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⠋⠀⠀⠀⠀⠀⠀⠀⠀⢻⡄⠀⠈⡇⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢻⡄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠘⢿⣦⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣰⡿⠁⠀⠀⠀⠀⠀⠈⠻⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣿⡀⠀⡇⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢷⡀⠀⠀⠀⠀⠀⠀⠀⢰⠀⠀⠀⠀⠀⠀⠀⢽⣧⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣴⠏⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠙⠢⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢠⣿⢷⠀⡇⠀⠀⠀⠀⠀⠀
-** ⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠈⢧⠀⠀⠀⠀⠀⠀⠀⠈⠃⠀⠀⠀⠀⠀⠀⠀⠘⢷⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣠⣾⠃⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⡀⠓⢀⣀⠀⠁⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣼⠃⠘⣷⡇⠀⠀⠀⠀⠀⠀
-**
-**
-**  SOME BLACK MAGIC HAPPENING HERE ** 
-**************************************/
-
-size_t compress(const std::vector<char>& inputBuffer, std::vector<char>& outputBuffer)
-{
-	uint32_t bitBuffer = 0;
-	uint32_t bitMask = 0x8000;
-	int searchWindow = 2047;
-	size_t size = inputBuffer.size() / sizeof(uint16_t);
-	const uint16_t* inp = reinterpret_cast<const uint16_t*>(inputBuffer.data());
-
-	outputBuffer.clear();
-	outputBuffer.resize(size * 2 + 2048);
-
-	uint16_t* outPtr = reinterpret_cast<uint16_t*>(outputBuffer.data());
-
-	const uint16_t* inPtr = inp;
-	const uint16_t* inEnd = inp + size;
-
-	uint16_t* flagWordPtr = outPtr++;
-	*flagWordPtr = 0;
-
-	while (inPtr < inEnd) {
-		if (bitMask == 0) {
-			flagWordPtr = outPtr++;
-			*flagWordPtr = 0;
-			bitMask = 0x8000;
-		}
-
-		const uint16_t* searchEnd = (inPtr - searchWindow) > inp ? (inPtr - searchWindow) : inp;
-
-		const uint16_t* bestMatch = nullptr;
-		uint32_t bestLength = 0;
-		const uint16_t* searchPtr = inPtr - 1;
-
-		while (searchPtr >= searchEnd) {
-			uint32_t length = 0;
-			while (searchPtr[length] == inPtr[length] && (inPtr + length) < inEnd && length < 11) {
-				length++;
-			}
-			if (length > bestLength) {
-				bestLength = length;
-				bestMatch = searchPtr;
-			}
-			searchPtr--;
-		}
+struct packOptions
+{
+	compressOptions copts;
+	// skip subtrees whose files all match their stamps in .metadata
+	bool incremental = false;
+	// MOMO entries with the same contents share one copy of the data
+	bool dedup = false;
+};
+
+bool pack(const char*, const packOptions&);
+
+// Tasks submitted together, wait() returns when all of them have run
+struct taskGroup
+{
+	std::atomic<size_t> pending{0};
+};
+
+// Work-stealing pool. Every worker pushes and pops at the back of its own
+// deque and steals from the front of the others; threads that aren't
+// workers share queue 0. A worker in wait() runs queued tasks instead of
+// blocking, so a task can wait on the tasks it spawned (nested archives)
+// without starving the pool. With one thread everything runs inline, in
+// submission order.
+class taskPool
+{
+public:
+	explicit taskPool(unsigned threads)
+	{
+		if(threads <= 1)
+			return;
+		for(unsigned i = 0; i <= threads; i++)
+			queues.emplace_back(new taskQueue);
+		for(unsigned i = 1; i <= threads; i++)
+			workers.emplace_back([this, i] { workerLoop(i); });
+	}
 
-		if (bestLength >= 2) {
-			uint32_t offset = inPtr - bestMatch;
-			*outPtr++ = (bestLength << 11) | offset;
-			inPtr += bestLength;
-			*flagWordPtr |= bitMask;
-		} else {
-			*outPtr++ = *inPtr++;
+	~taskPool()
+	{
+		stop = true;
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			sleepCv.notify_all();
 		}
-		bitMask >>= 1;
+		for(std::thread& t : workers)
+			t.join();
 	}
 
-	if (bitMask != 0x8000) {
-		*flagWordPtr |= bitMask;
+	void submit(taskGroup& group, std::function<void()> fn)
+	{
+		if(workers.empty())
+		{
+			fn();
+			return;
+		}
+		group.pending++;
+		taskQueue& q = *queues[self < queues.size() ? self : 0];
+		{
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.tasks.push_back({std::move(fn), &group});
+			queued++;
+		}
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		sleepCv.notify_one();
 	}
 
-	size_t outputSize = (reinterpret_cast<char*>(outPtr) - outputBuffer.data());
+	// Workers run queued tasks while they wait, or the tasks they wait on
+	// could be stuck behind them. Other threads only sleep until the group
+	// is done, so no more than threads tasks ever run at once.
+	void wait(taskGroup& group)
+	{
+		bool worker = self < queues.size();
+		while(group.pending != 0)
+		{
+			if(worker && runOne(self))
+				continue;
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleepCv.wait(lock, [&] { return group.pending == 0 || (worker && queued != 0); });
+		}
+	}
 
-	size_t align = (outputSize / 2048) * 2048;
-	if(align == 0 || align < outputSize)
-		align += 2048;
+private:
+	struct task
+	{
+		std::function<void()> fn;
+		taskGroup* group;
+	};
 
-	outputBuffer.resize(align);
-	return align;
-}
+	struct taskQueue
+	{
+		std::mutex mutex;
+		std::deque<task> tasks;
+	};
+
+	std::vector<std::unique_ptr<taskQueue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<bool> stop{false};
+	std::atomic<size_t> queued{0};
+	std::mutex sleepMutex;
+	std::condition_variable sleepCv;
+	static thread_local size_t self;
+
+	bool take(size_t id, task& t)
+	{
+		{
+			taskQueue& own = *queues[id];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if(!own.tasks.empty())
+			{
+				t = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				queued--;
+				return true;
+			}
+		}
+		for(size_t i = 1; i <= queues.size(); i++)
+		{
+			taskQueue& victim = *queues[(id + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if(!victim.tasks.empty())
+			{
+				t = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				queued--;
+				return true;
+			}
+		}
+		return false;
+	}
 
-size_t decompress(int16_t* inputBuffer, int16_t* outputBuffer, size_t size) {
-	uint32_t bitBuffer = 0;
-	uint32_t bitMask = 0;
-	int16_t* inpPtr = inputBuffer;
-	int16_t* outPtr = outputBuffer;
-	int16_t* inpEnd = inputBuffer + size / sizeof(int16_t);
+	bool runOne(size_t id)
+	{
+		task t;
+		if(!take(id, t))
+			return false;
+		t.fn();
+		if(--t.group->pending == 0)
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			sleepCv.notify_all();
+		}
+		return true;
+	}
 
-	while (inpPtr < inpEnd) {
-		if (bitMask == 0) {
-			if (inpPtr >= inpEnd) break;
-			bitBuffer = *inpPtr;
-			bitMask = 0x8000;
-			inpPtr++;
+	void workerLoop(size_t id)
+	{
+		self = id;
+		while(!stop)
+		{
+			if(runOne(id))
+				continue;
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleepCv.wait_for(lock, std::chrono::milliseconds(10));
 		}
+	}
+};
 
-		if ((bitMask & bitBuffer) == 0) {
-			if (inpPtr >= inpEnd) break;
-			*outPtr = *inpPtr;
-			inpPtr++;
-			outPtr++;
-		} else {
-			if (inpPtr >= inpEnd) break;
-			uint16_t controlWord = *inpPtr;
-			inpPtr++;
-			uint32_t offset = controlWord & 0x7FF;
-			uint32_t length = controlWord >> 11;  // 0xB
+thread_local size_t taskPool::self = SIZE_MAX;
 
-			if (length == 0) {
-				if (inpPtr >= inpEnd) break;
-				length = *inpPtr;
-				inpPtr++;
-			}
+// View of bytes that live in a buffer or a mapped file. Views of buffers
+// made along the way (decompressed entries) share ownership of them, so
+// they can be handed to the writer and outlive the parser that made them.
+struct byteView
+{
+	const char* data = nullptr;
+	size_t size = 0;
+	std::shared_ptr<const std::vector<char>> keep;
 
-			if (offset == 0) {
-				if (length == 0) break;
-				std::memset(outPtr, 0, length * sizeof(int16_t));
-				outPtr += length;
-			} else {
-				int16_t* copySrc = outPtr - offset;
-				for (uint32_t i = 0; i < length; i++) {
-					*outPtr = *copySrc;
-					outPtr++;
-					copySrc++;
-				}
-			}
-		}
+	byteView() {}
+	byteView(const char* d, size_t s) : data(d), size(s) {}
+	byteView(const std::vector<char>& v) : data(v.data()), size(v.size()) {}
+	byteView(std::shared_ptr<const std::vector<char>> v) : data(v->data()), size(v->size()), keep(std::move(v)) {}
 
-		bitMask >>= 1;
+	bool contains(size_t o, size_t n) const
+	{
+		return o <= size && n <= size - o;
 	}
-	return (outPtr - outputBuffer) * sizeof(int16_t);
-}
 
-enum fileType
-{
-	unk = -1,
-	tim2,
-	ptx, // where offset is 2048 (0x800)
-	ipu,
-	icon_sys, // aka icon.sys file
-	ps2icn,	  // ps2 icon
-	momo
+	// caller checks contains() first
+	byteView sub(size_t o, size_t n) const
+	{
+		byteView v(data + o, n);
+		v.keep = keep;
+		return v;
+	}
 };
 
-const char* fileTypeExt(fileType ft)
+// Cursor over a byteView for the parsers. Reads past the end set failed
+// and zero the target instead of touching memory outside the view.
+struct byteReader
 {
-	switch (ft) {
-		case momo: return "bin";
-		case tim2: return "tm2";
-		case ptx: return "ptx";
-		case ipu: return "ipu";
-		case icon_sys: return "icon.sys";
-		case ps2icn: return "icn";
-		default: return "unk";
+	byteView view;
+	size_t pos = 0;
+	bool failed = false;
+
+	byteReader(byteView v) : view(v) {}
+
+	bool seek(size_t p)
+	{
+		if(p > view.size)
+			return fail();
+		pos = p;
+		return true;
 	}
-}
 
-fileType findFileType(std::vector<char>& f, size_t fsize)
-{
-	char magic[4] = {f[0], f[1], f[2], f[3]};
-	char momoHeader[4] = {'M', 'O', 'M', 'O'};
-	char tim2Header[4] = {'T', 'I', 'M', '2'};
-	char ipumHeader[4] = {'i', 'p', 'u', 'm'};
-	char ps2dHeader[4] = {'P', 'S', '2', 'D'};
+	bool skip(size_t n)
+	{
+		if(!view.contains(pos, n))
+			return fail();
+		pos += n;
+		return true;
+	}
 
-	if((magic[2] == momoHeader[0] && magic[3] == momoHeader[1] && magic[0] != momoHeader[0]) || (magic[2] == tim2Header[0] && magic[3] == tim2Header[1]))
+	template<typename T>
+	bool read(T& v)
 	{
-		char tmp[4] = {f[2], f[3], f[4], f[5]};
-		if(memcmp(tmp, tim2Header, 4) == 0 || memcmp(tmp, momoHeader, 4) == 0)
+		static_assert(std::is_trivially_copyable<T>::value, "plain data only");
+		if(!view.contains(pos, sizeof(T)))
 		{
-			std::vector<char> decompressed_data(DBUFFER_SIZE * sizeof(int16_t));
-			size_t decompressed_size = decompress(reinterpret_cast<int16_t*>(f.data()), reinterpret_cast<int16_t*>(decompressed_data.data()), fsize);
-			
-			if (decompressed_size == 0) return unk;
-
-			decompressed_data.resize(decompressed_size);
-			f = std::move(decompressed_data);
-			return findFileType(f, decompressed_size);
+			memset(&v, 0, sizeof(T));
+			return fail();
 		}
+		memcpy(&v, view.data + pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
 	}
-	else if(memcmp(magic, momoHeader, 4) == 0)
-		return momo;
-	else if(memcmp(magic, tim2Header, 4) == 0)
-		return tim2;
-	else if(memcmp(magic, ipumHeader, 4) == 0)
-		return ipu;
-	else if(memcmp(magic, ps2dHeader, 4) == 0)
-		return icon_sys;
-	else if(memcmp(magic, "\x00\x00\x01\x00", 4) == 0)
-		return ps2icn;
-	else{
-		if(fsize > (2048 + 512)){ // offset + some data stuff
-			char lm[4] = {f[2048], f[2049], f[2050], f[2051]};
-			if(memcmp(lm, tim2Header, 4) == 0)
-				return ptx;
-			else
-			{
-				auto findCompressedPtx = std::search(f.begin(), f.end(), std::begin(tim2Header), std::end(tim2Header));
-				if(findCompressedPtx != f.end())
-				{
-					std::vector<char> decompressed_data(DBUFFER_SIZE * sizeof(int16_t));
-					size_t decompressed_size = decompress(reinterpret_cast<int16_t*>(f.data()), reinterpret_cast<int16_t*>(decompressed_data.data()), decompressed_data.size());
-					if (decompressed_size == 0) return unk;
-					decompressed_data.resize(decompressed_size);
-					f = std::move(decompressed_data);
-					return findFileType(f, decompressed_size);
-				}
-			}
+
+	// next n bytes as a view into the same memory
+	byteView take(size_t n)
+	{
+		if(!view.contains(pos, n))
+		{
+			fail();
+			return byteView();
 		}
+		byteView v = view.sub(pos, n);
+		pos += n;
+		return v;
 	}
 
-	return unk;
-}
-
-fileType findFileType(const char* path)
-{
-	std::ifstream f(path, std::ios::binary | std::ios::ate);
-	size_t fsize = f.tellg();
-	f.seekg(0, std::ios::beg);
-	std::vector<char> buff(fsize);
-	f.read(buff.data(), buff.size());
-	f.close();
-	return findFileType(buff, fsize);
-}
+	size_t remaining() const
+	{
+		return view.size - pos;
+	}
 
-struct ipumHeader
-{
-	char magic[4];
-	uint32_t unk1;
-	uint32_t unk2;
-	uint32_t frameCount;
-	uint32_t framerate;
+private:
+	bool fail()
+	{
+		failed = true;
+		return false;
+	}
 };
 
-void ipumPack(std::string dirname, std::string metadataFile, std::string origPath)
+#define WQUEUE_BYTES (64 * 1024 * 1024) // extracted data waiting for the disk
+
+// Background writer for extracted files. Parsers hand finished buffers over
+// and carry on; push() blocks while WQUEUE_BYTES are already waiting. The
+// first failed write is kept, later ones are dropped, finish() reports it.
+class writeQueue
 {
-	// header aka .meta.your.ipu
-	// dds size
-	// dds data
-	// frame end aka frame0.meta
-	bool isc = false;
-	std::string basename, line;
-	std::filesystem::path _tp = dirname;
-	std::vector<std::string> files;
+public:
+	writeQueue() : worker([this] { run(); }) {}
 
-	std::ifstream meta(metadataFile);
-	std::getline(meta, basename);
+	~writeQueue()
+	{
+		finish();
+	}
 
-	while(std::getline(meta, line))
+	// data has to stay valid until finish(), or own its buffer
+	void push(const std::string& path, byteView data)
+	{
+		std::unique_lock<std::mutex> lock(m);
+		space.wait(lock, [&] { return bytes == 0 || bytes + data.size <= WQUEUE_BYTES || !err.empty(); });
+		if(!err.empty())
+			return;
+		bytes += data.size;
+		items.push_back({path, std::move(data), nullptr});
+		ready.notify_one();
+	}
+
+	// text made on the writer thread, once everything queued before it
+	// is on disk
+	void push(const std::string& path, std::function<std::string()> make)
+	{
+		std::unique_lock<std::mutex> lock(m);
+		if(!err.empty())
+			return;
+		items.push_back({path, byteView(), std::move(make)});
+		ready.notify_one();
+	}
+
+	// Waits for everything queued to reach the disk. False when a write
+	// failed, error() says which.
+	bool finish()
 	{
-		if(line.find("_compressed") != std::string::npos)
 		{
-			isc = true;
-			continue;
+			std::lock_guard<std::mutex> lock(m);
+			stop = true;
 		}
-		if(line == "") break;
-		_tp = _tp.append(line);
-		files.push_back(_tp.string());
-		_tp = dirname;
+		ready.notify_one();
+		if(worker.joinable())
+			worker.join();
+		return err.empty();
+	}
 
+	const std::string& error() const
+	{
+		return err;
 	}
-	meta.close();
 
-	std::string fn = origPath + ".bak";
-	if(!std::filesystem::exists(fn))
+private:
+	struct item
+	{
+		std::string path;
+		byteView data;
+		std::function<std::string()> make;
+	};
+
+	std::mutex m;
+	std::condition_variable ready;
+	std::condition_variable space;
+	std::deque<item> items;
+	size_t bytes = 0;
+	bool stop = false;
+	std::string err;
+	std::thread worker;
+
+	void run()
 	{
-		std::ifstream _fib(origPath, std::ios::binary);
-		std::ofstream _fob(fn, std::ios::binary);
-		_fob << _fib.rdbuf();
-		_fob.close();
-		_fib.close();
+		std::unique_lock<std::mutex> lock(m);
+		for(;;)
+		{
+			ready.wait(lock, [&] { return stop || !items.empty(); });
+			if(items.empty())
+				return;
+			item it = std::move(items.front());
+			items.pop_front();
+			lock.unlock();
+
+			std::string text;
+			if(it.make)
+				text = it.make();
+			const char* d = it.make ? text.data() : it.data.data;
+			size_t n = it.make ? text.size() : it.data.size;
+			size_t queued = it.data.size;
+			FILE* f = fopen(it.path.c_str(), "wb");
+			bool ok = f && fwrite(d, 1, n, f) == n;
+			int e = errno;
+			if(f && fclose(f) != 0 && ok)
+			{
+				ok = false;
+				e = errno;
+			}
+			it.data = byteView();
+
+			lock.lock();
+			if(!ok && err.empty())
+				err = it.path + ": " + strerror(e);
+			bytes -= queued;
+			space.notify_all();
+		}
 	}
+};
 
-	std::ostringstream f(std::ios::binary);
+// Whole input file, either memory-mapped (pages come from the page cache
+// as the parsers touch them) or read into a buffer
+class inputFile
+{
+public:
+	inputFile() {}
+	inputFile(const inputFile&) = delete;
+	inputFile& operator=(const inputFile&) = delete;
 
-	_tp = _tp.append(".meta." + basename);
-	std::ifstream ipuHeader(_tp.string(), std::ios::binary);
-	f << ipuHeader.rdbuf();
-	ipuHeader.close();
+	~inputFile()
+	{
+		unmap();
+	}
 
+	bool open(const char* path, bool map)
+	{
+		if(map && mapFile(path))
+			return true;
+
+		std::ifstream f(path, std::ios::binary | std::ios::ate);
+		if(!f.is_open())
+			return false;
+		size_t fsize = f.tellg();
+		f.seekg(0, std::ios::beg);
+		buffer.resize(fsize);
+		f.read(buffer.data(), buffer.size());
+		return true;
+	}
 
-	for(size_t i = 0; i < files.size(); i++)
-	{	
-		printf("-- Writing \"%s\"\n", files[i].c_str());
-		std::ifstream _t(files[i], std::ios::binary | std::ios::ate);
-		size_t fsize = _t.tellg();
-		_t.seekg(0, std::ios::beg);
-		printf("   Size: %lu\n", fsize);
-		f << "frmj";
-		f.write(reinterpret_cast<char*>(&fsize), sizeof(uint32_t));
-		f << _t.rdbuf();
-		_t.close();
-		std::string ddsMeta = files[i].erase(files[i].size() - 3) + "meta";
-		_t.open(ddsMeta, std::ios::binary);
-		_t.seekg(0, std::ios::beg);
-		f.seekp(-4, std::ios::cur);
-		f << _t.rdbuf();
-		_t.close();
+	byteView view() const
+	{
+		if(mapped)
+			return byteView(static_cast<const char*>(mapped), mappedSize);
+		return byteView(buffer);
 	}
 
-	std::vector<char> buff;
-	std::string _buff = f.str();
-	buff.insert(buff.end(), _buff.begin(), _buff.end());
-	if(isc)
+private:
+	std::vector<char> buffer;
+	void* mapped = nullptr;
+	size_t mappedSize = 0;
+
+#ifdef _WIN32
+	bool mapFile(const char* path)
 	{
-		printf("-- Compressing file\n");
-		size_t _size = buff.size();
-		std::vector<char> out(_size / 2);
-		size_t csize = compress(buff, out);
-		out.resize(csize);
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if(file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fsize;
+		HANDLE mapping = nullptr;
+		if(GetFileSizeEx(file, &fsize) && fsize.QuadPart > 0)
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if(!mapping)
+			return false;
+		mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if(!mapped)
+			return false;
+		mappedSize = fsize.QuadPart;
+		return true;
+	}
 
-		buff = std::move(out);
+	void unmap()
+	{
+		if(mapped)
+			UnmapViewOfFile(mapped);
+	}
+#else
+	bool mapFile(const char* path)
+	{
+		int fd = ::open(path, O_RDONLY);
+		if(fd < 0)
+			return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close(fd);
+			return false;
+		}
+		void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(p == MAP_FAILED)
+			return false;
+		mapped = p;
+		mappedSize = st.st_size;
+		return true;
 	}
-	std::ofstream _f(origPath, std::ios::binary);
-	_f.write(buff.data(), buff.size());
-	_f.close();
 
-}
+	void unmap()
+	{
+		if(mapped)
+			munmap(mapped, mappedSize);
+	}
+#endif
+};
 
-void ipumUnpack(std::vector<char>& buffer, const char* dirname, std::filesystem::path basename, bool isc)
+// XXH64, to tell files and entries apart without keeping them around
+class hash64
 {
-	std::istringstream f(std::string(buffer.begin(), buffer.end()), std::ios::binary);
-	f.seekg(0, std::ios::beg);
-	ipumHeader ipu;
-	f.read(reinterpret_cast<char*>(&ipu), sizeof(ipu));
-	printf("-- Ipum frame count: %i\n", ipu.frameCount);
-	if(!std::filesystem::is_directory(dirname))
+public:
+	hash64(uint64_t seed = 0)
 	{
-		if(std::filesystem::create_directory(dirname))
+		v[0] = seed + P1 + P2;
+		v[1] = seed + P2;
+		v[2] = seed;
+		v[3] = seed - P1;
+		this->seed = seed;
+	}
+
+	void update(const void* data, size_t n)
+	{
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		total += n;
+		if(used + n < 32)
 		{
-			printf("-- Directory \"%s\" created\n", dirname);
+			memcpy(tail + used, p, n);
+			used += n;
+			return;
+		}
+		if(used)
+		{
+			size_t fill = 32 - used;
+			memcpy(tail + used, p, fill);
+			stripe(tail);
+			p += fill;
+			n -= fill;
+			used = 0;
 		}
+		for(; n >= 32; p += 32, n -= 32)
+			stripe(p);
+		memcpy(tail, p, n);
+		used = n;
 	}
 
-	char* _metan = new char[strlen(dirname) + 12];
-	sprintf(_metan, "%s/.metadata", dirname);
-	std::vector<std::string> _meta;
-	_meta.push_back(basename.string());
-	if(isc)
-		_meta.push_back("_compressed");
-	printf("-- Creating \"%s/.metadata\" file\n", dirname);
-	std::ofstream _metadata(_metan, std::ios::out);
-	for(const auto e : _meta)
+	uint64_t digest() const
 	{
-		_metadata << e << '\n';
+		uint64_t h;
+		if(total >= 32)
+		{
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for(int i = 0; i < 4; i++)
+				h = (h ^ round(0, v[i])) * P1 + P4;
+		}
+		else
+			h = seed + P5;
+		h += total;
+
+		const uint8_t* p = tail;
+		size_t n = used;
+		for(; n >= 8; p += 8, n -= 8)
+			h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		if(n >= 4)
+		{
+			uint32_t w;
+			memcpy(&w, p, 4);
+			h = rotl(h ^ (w * P1), 23) * P2 + P3;
+			p += 4;
+			n -= 4;
+		}
+		for(; n > 0; p++, n--)
+			h = rotl(h ^ (*p * P5), 11) * P1;
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
 	}
 
-	// sprintf(tc, "%s/.meta.%s", dirname, basename.string().c_str());
-	std::filesystem::path tc = dirname;
-	tc = tc.append(".meta." + basename.string());
-	std::ofstream metadata(tc, std::ios::binary);
-	metadata.write(reinterpret_cast<char*>(&ipu), sizeof(ipu));
-	metadata.close();
+private:
+	static constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+	static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+	static constexpr uint64_t P3 = 0x165667B19E3779F9ull;
+	static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+	static constexpr uint64_t P5 = 0x27D4EB2F165667C5ull;
 
-	for(uint32_t i = 0; i < ipu.frameCount; i++)
+	uint64_t v[4];
+	uint64_t seed;
+	uint64_t total = 0;
+	uint8_t tail[32];
+	size_t used = 0;
+
+	static uint64_t rotl(uint64_t x, int r)
 	{
-		char frameStart[4];
-		char frameEnd[4];
-		uint32_t tSize;
-		f.read(frameStart, 4);
-		f.read(reinterpret_cast<char*>(&tSize), 4);
-		char* texture = new char[tSize];
-		f.read(texture, tSize-4);
-		f.read(frameEnd, 4);
-		char* tn = new char[strlen(dirname) + sizeof(uint32_t) + 12];
-		sprintf(tn, "%s/frame%i.dds", dirname, i);
-		_metadata << "frame" << i << ".dds" << '\n';
-		char* tnm = new char[strlen(dirname) + sizeof(uint32_t) + 12 + 1];
-		sprintf(tnm, "%s/frame%i.meta", dirname, i);
-		printf("-- Writing texture to \"%s\"\n", tn);
-		std::ofstream dt(tnm, std::ios::binary);
-		dt.write(frameEnd, 4);
-		dt.close();
-		std::ofstream dds(tn, std::ios::binary);
-		dds.write(texture, tSize);
-		delete [] texture;
-		dds.close();
-		delete [] tnm;
-		delete [] tn;
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static uint64_t read64(const uint8_t* p)
+	{
+		uint64_t x;
+		memcpy(&x, p, 8);
+		return x;
+	}
+
+	static uint64_t round(uint64_t acc, uint64_t in)
+	{
+		return rotl(acc + in * P2, 31) * P1;
+	}
+
+	void stripe(const uint8_t* p)
+	{
+		for(int i = 0; i < 4; i++)
+			v[i] = round(v[i], read64(p + i * 8));
 	}
+};
 
-	delete [] _metan;
-	_metadata.close();
+uint64_t hashBytes(byteView b)
+{
+	hash64 h;
+	h.update(b.data, b.size);
+	return h.digest();
 }
-struct Tim2Header
+
+std::string hashHex(uint64_t h)
 {
-	char magic[4];
-	char formatVer;
-	char formatId;
-	uint16_t count;
-	// char pad[8];
-	// Maybe:
-	uint32_t texOff;
-	uint32_t texSize;
-	//
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+	return hex;
+}
+
+// Size, mtime and hash of a file as unpack left it, so pack can tell
+// which files were edited since. known is false for .metadata written
+// before these were recorded. Entries also keep where they were in the
+// archive (placed).
+struct fileStamp
+{
+	std::string name;
+	size_t size = 0;
+	int64_t mtime = 0;
+	uint64_t hash = 0;
+	bool known = false;
+	uint64_t offset = 0;
+	bool placed = false;
+	// hash still being computed, .metadata waits for it
+	std::shared_future<uint64_t> pendingHash;
 };
 
-struct GsTex {
-	unsigned long TBP0 : 14;
-	unsigned long TBW : 6;
-	unsigned long PSM : 6;
-	unsigned long TW : 4;
-	unsigned long TH : 4;
-	unsigned long TCC : 1;
-	unsigned long TFX : 2;
-	unsigned long CBP : 14;
-	unsigned long CPSM : 4;
-	unsigned long CSM : 1;
-	unsigned long CSA : 5;
-	unsigned long CLD : 3;
+enum fileType
+{
+	unk = -1,
+	tim2,
+	ptx, // where offset is 2048 (0x800)
+	ipu,
+	icon_sys, // aka icon.sys file
+	ps2icn,	  // ps2 icon
+	momo
 };
 
-struct Tim2PicHeader
+const char* fileTypeExt(fileType ft)
 {
-	uint32_t totalSize;
-	uint32_t clutSize;
-	uint32_t imgSize;
-	uint16_t headerSize;
-	uint16_t clutColors;
-	char picFormat;
-	char MipMapTextures;
-	char clutType;
-	char ImageType;
-	uint16_t ImageWidth;
-	uint16_t ImageHeight;
+	switch (ft) {
+		case momo: return "bin";
+		case tim2: return "tm2";
+		case ptx: return "ptx";
+		case ipu: return "ipu";
+		case icon_sys: return "icon.sys";
+		case ps2icn: return "icn";
+		default: return "unk";
+	}
+}
 
-	GsTex GsTex0;
-	GsTex GsTex1;
-	uint32_t GsTexaFbaPabe;
-	uint32_t GsTexClut;
-};
+fileType fileTypeOfExt(const std::string& ext)
+{
+	for(fileType ft : {tim2, ptx, ipu, icon_sys, ps2icn, momo})
+		if(ext == fileTypeExt(ft))
+			return ft;
+	return unk;
+}
 
-void tim2Pack(std::string dirname, std::string metadataFile, std::string origPath)
+// Contents of a .metadata file. The first line is the archive name, lines
+// starting with '_' are directives and the rest are entries in archive
+// order, each optionally followed by its stamp (tab separated).
+//   _version <n>         format version, 1 when missing
+//   _compressed          the archive is compressed
+//   _type <ext>          what kind of archive it is (fileTypeExt)
+//   _layout <name>       format variant, "block" or "mini" for MOMO tables
+//   _align <n>           entries start at multiples of n
+//   _source <stamp>      the archive as it was unpacked
+//   _part <stamp>        a file the packer reads besides the entries
+// A stamp is size, mtime and hash, for entries then the original offset.
+// From version 2 every entry has to carry a full stamp; version 1 files
+// still read, the packers look up what they lack.
+#define METADATA_VERSION 2
+
+struct metaInfo
 {
-	std::ifstream meta(metadataFile);
 	std::string basename;
-	std::string _tmpc;
-	std::getline(meta, basename);
-	std::getline(meta, _tmpc);
-	meta.close();
-
-	bool isc = false;
-	if(_tmpc != "")
-		isc = true;
+	int version = 1;
+	bool compressed = false;
+	fileType type = unk;
+	std::string layout;
+	size_t align = 0;
+	fileStamp source;
+	std::vector<fileStamp> entries;
+	std::vector<fileStamp> parts;
+};
 
-	std::filesystem::path texFile = dirname;
-	texFile = texFile.append(basename + ".dds");
-	std::filesystem::path texMetaFile = dirname;
-	texMetaFile = texMetaFile.append(".meta." + basename);
+int64_t fileTime(const std::filesystem::path& path)
+{
+	std::error_code ec;
+	auto t = std::filesystem::last_write_time(path, ec);
+	return ec ? 0 : int64_t(t.time_since_epoch().count());
+}
 
-	std::vector<char> tim2;
+std::string stampLine(const fileStamp& st)
+{
+	if(!st.known)
+		return st.name;
+	std::string line = st.name + '\t' + std::to_string(st.size) + '\t' + std::to_string(st.mtime) + '\t' + hashHex(st.hash);
+	if(st.placed)
+		line += '\t' + std::to_string(st.offset);
+	return line;
+}
 
-	std::ifstream _tim2(texMetaFile, std::ios::binary);
-	if(!_tim2.is_open())
+fileStamp parseStamp(const std::string& line)
+{
+	fileStamp st;
+	size_t tab = line.find('\t');
+	st.name = line.substr(0, tab);
+	unsigned long long size, hash, offset;
+	long long mtime;
+	int n = tab == std::string::npos ? 0 : sscanf(line.c_str() + tab, "\t%llu\t%lld\t%llx\t%llu", &size, &mtime, &hash, &offset);
+	if(n >= 3)
 	{
-		printErr("Cannot open \"%s\"", texMetaFile.string().c_str());
-		exit(-1);
+		st.size = size;
+		st.mtime = mtime;
+		st.hash = hash;
+		st.known = true;
 	}
-	Tim2Header t2header;
-	Tim2PicHeader t2pic;
-	_tim2.seekg(0, std::ios::end);
-	size_t ts = _tim2.tellg();
-	_tim2.seekg(0, std::ios::beg);
-	_tim2.read(reinterpret_cast<char*>(&t2header), sizeof(t2header));
-	std::vector<char> addData;
-	std::vector<char> addData2;
-	if(t2header.formatId != 0x0)
+	if(n == 4)
 	{
-		addData.resize(128 - _tim2.tellg());
-		_tim2.read(addData.data(), addData.size());
+		st.offset = offset;
+		st.placed = true;
 	}
-	_tim2.read(reinterpret_cast<char*>(&t2pic), sizeof(t2pic));
-	size_t s = _tim2.tellg();
-	if(ts > s)
+	return st;
+}
+
+bool readMetadata(const std::string& path, metaInfo& m)
+{
+	std::ifstream meta(path);
+	if(!std::getline(meta, m.basename))
+		return false;
+	std::string line;
+	while(std::getline(meta, line))
 	{
-		addData2.resize(ts-s);
-		_tim2.read(addData2.data(), (ts - s));
+		if(line == "") break;
+		if(line.rfind("_version ", 0) == 0)
+		{
+			m.version = atoi(line.c_str() + 9);
+			if(m.version < 1 || m.version > METADATA_VERSION)
+				return false;
+		}
+		else if(line.find("_compressed") != std::string::npos)
+			m.compressed = true;
+		else if(line.rfind("_align ", 0) == 0)
+			m.align = strtoull(line.c_str() + 7, nullptr, 10);
+		else if(line.rfind("_type ", 0) == 0)
+			m.type = fileTypeOfExt(line.substr(6));
+		else if(line.rfind("_layout ", 0) == 0)
+			m.layout = line.substr(8);
+		else if(line.rfind("_source ", 0) == 0)
+			m.source = parseStamp(line.substr(8));
+		else if(line.rfind("_part ", 0) == 0)
+			m.parts.push_back(parseStamp(line.substr(6)));
+		else
+		{
+			m.entries.push_back(parseStamp(line));
+			if(m.version >= 2 && !m.entries.back().known)
+				return false;
+		}
 	}
-	size_t hS = _tim2.tellg();
-	_tim2.close();
+	return true;
+}
 
+std::string formatMetadata(const metaInfo& m)
+{
+	std::string text = m.basename + '\n';
+	text += "_version " + std::to_string(METADATA_VERSION) + '\n';
+	if(m.compressed)
+		text += "_compressed\n";
+	if(m.type != unk)
+		text += std::string("_type ") + fileTypeExt(m.type) + '\n';
+	if(!m.layout.empty())
+		text += "_layout " + m.layout + '\n';
+	if(m.align)
+		text += "_align " + std::to_string(m.align) + '\n';
+	if(m.source.known)
+		text += "_source " + stampLine(m.source) + '\n';
+	for(const fileStamp& e : m.entries)
+		text += stampLine(e) + '\n';
+	for(const fileStamp& e : m.parts)
+		text += "_part " + stampLine(e) + '\n';
+	return text;
+}
 
-	std::ifstream _dds(texFile, std::ios::binary | std::ios::ate);
-	if(!_dds.is_open())
-	{
-		printErr("Cannot open \"%s\"", texFile.string().c_str());
-		exit(-1);
-	}
-	size_t ddsSize = _dds.tellg();
+// .metadata goes through the writer after every file it lists, so the
+// mtimes recorded are the ones those files got on disk
+void queueMetadata(writeQueue& out, const std::string& dirname, metaInfo m)
+{
+	printf("-- Creating \"%s/.metadata\" file\n", dirname.c_str());
+	std::filesystem::path dir = dirname;
+	out.push((dir / ".metadata").string(), [dir, m]() mutable {
+		if(m.source.pendingHash.valid())
+			m.source.hash = m.source.pendingHash.get();
+		if(m.source.known)
+			m.source.mtime = fileTime(dir.parent_path() / m.source.name);
+		for(fileStamp& e : m.entries)
+			e.mtime = fileTime(dir / e.name);
+		for(fileStamp& e : m.parts)
+			e.mtime = fileTime(dir / e.name);
+		return formatMetadata(m);
+	});
+}
 
-	_dds.seekg(12, std::ios::beg);
-	uint32_t w, h;
-	_dds.read(reinterpret_cast<char*>(&w), sizeof(uint32_t));
-	_dds.read(reinterpret_cast<char*>(&h), sizeof(uint32_t));
-	_dds.seekg(0, std::ios::beg);
+fileStamp stampOf(const std::string& name, byteView data)
+{
+	fileStamp st;
+	st.name = name;
+	st.size = data.size;
+	st.hash = hashBytes(data);
+	st.known = true;
+	return st;
+}
 
-	std::vector<char> ddsData(ddsSize);
-	_dds.read(ddsData.data(), ddsData.size());
+// Replaces f with its decompressed contents, sized exactly by a pre-pass.
+// Returns the new size, 0 (and f untouched) if it doesn't decode.
+size_t decompressBuffer(byteView f, std::vector<char>& out)
+{
+	const int16_t* in = reinterpret_cast<const int16_t*>(f.data);
+	size_t dsize = decompressedSize(in, f.size);
+	if (dsize == 0) return 0;
 
-	/// :( don't works....
-	// GsTex tex = t2pic.GsTex0;
-	// t2header.texSize = ddsSize;
-	// t2pic.ImageWidth = w;
-	// t2pic.ImageHeight = h;
-	//
-	// tex.TW = log2(w);
-	// tex.TH = log2(h);
-	//
-	// t2pic.GsTex0 = tex;
+	std::vector<char> decompressed_data(dsize);
+	if (decompress(in, reinterpret_cast<int16_t*>(decompressed_data.data()), f.size, dsize) != dsize)
+		return 0;
 
-	t2pic.imgSize = ddsSize;
-	t2pic.totalSize = ddsSize + hS - t2pic.headerSize;
+	out = std::move(decompressed_data);
+	return dsize;
+}
 
+#define SNIFF_SIZE 0x1000 // decompressed bytes needed to tell the type
+#define SNIFF_READ (64 * 1024) // compressed PTX shows "TIM2" well before this
 
-	tim2.insert(tim2.end(), reinterpret_cast<char*>(&t2header), reinterpret_cast<char*>(&t2header) + sizeof(t2header));
-	if(t2header.formatId != 0x0)
-	{
-		tim2.insert(tim2.end(), addData.begin(), addData.end());
-	}
-	tim2.insert(tim2.end(), reinterpret_cast<char*>(&t2pic), reinterpret_cast<char*>(&t2pic) + sizeof(t2pic));
-	if(addData2.size() != 0)
-		tim2.insert(tim2.end(), addData2.begin(), addData2.end());
-	tim2.insert(tim2.end(), ddsData.begin(), ddsData.end());
-	_dds.close();
+const char momoMagic[4] = {'M', 'O', 'M', 'O'};
+const char tim2Magic[4] = {'T', 'I', 'M', '2'};
+const char ipumMagic[4] = {'i', 'p', 'u', 'm'};
+const char ps2dMagic[4] = {'P', 'S', '2', 'D'};
 
-	if(isc)
-	{
-		std::vector<char> out(tim2.size());
-		size_t csize = compress(tim2, out);
-		out.resize(csize);
+// flag word followed by a literal "TIM2" or "MOMO"
+bool looksCompressed(const char* f, size_t fsize)
+{
+	if(fsize < 6) return false;
+	if((f[2] == momoMagic[0] && f[3] == momoMagic[1] && f[0] != momoMagic[0]) || (f[2] == tim2Magic[0] && f[3] == tim2Magic[1]))
+		return memcmp(f + 2, tim2Magic, 4) == 0 || memcmp(f + 2, momoMagic, 4) == 0;
+	return false;
+}
 
-		tim2 = std::move(out);
+// type of uncompressed data, f holds at least the first bytes of fsize
+fileType plainFileType(const char* f, size_t n, size_t fsize)
+{
+	if(n < 4) return unk;
+	if(memcmp(f, momoMagic, 4) == 0)
+		return momo;
+	else if(memcmp(f, tim2Magic, 4) == 0)
+		return tim2;
+	else if(memcmp(f, ipumMagic, 4) == 0)
+		return ipu;
+	else if(memcmp(f, ps2dMagic, 4) == 0)
+		return icon_sys;
+	else if(memcmp(f, "\x00\x00\x01\x00", 4) == 0)
+		return ps2icn;
+	else if(fsize > (2048 + 512) && n >= 2052 && memcmp(f + 2048, tim2Magic, 4) == 0) // offset + some data stuff
+		return ptx;
+	return unk;
+}
+
+// Offset of the first "TIM2", "MOMO" or "ipum" in f, n if there's none.
+// Compares 16 candidate positions at a time where SSE2 is there.
+size_t scanMagic(const char* f, size_t n)
+{
+	auto isMagic = [&](size_t i) {
+		return i + 4 <= n && (memcmp(f + i, tim2Magic, 4) == 0 || memcmp(f + i, momoMagic, 4) == 0 || memcmp(f + i, ipumMagic, 4) == 0);
+	};
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i t = _mm_set1_epi8(tim2Magic[0]);
+	const __m128i m = _mm_set1_epi8(momoMagic[0]);
+	const __m128i p = _mm_set1_epi8(ipumMagic[0]);
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f + i));
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, t), _mm_cmpeq_epi8(v, m)), _mm_cmpeq_epi8(v, p));
+		for(unsigned bits = _mm_movemask_epi8(hit); bits; bits &= bits - 1)
+			if(isMagic(i + __builtin_ctz(bits)))
+				return i + __builtin_ctz(bits);
 	}
+#endif
+	for(; i < n; i++)
+		if(isMagic(i))
+			return i;
+	return n;
+}
 
-	std::string fn = origPath + ".bak";
-	if(!std::filesystem::exists(fn))
+// What findFileType() could tell from the start of a file
+struct typeProbe
+{
+	fileType type = unk;
+	bool compressed = false;
+	std::string layout;
+};
+
+std::string describeLayout(fileType ft, const char* f, size_t n)
+{
+	if(ft == momo && n >= 5)
+		return f[4] != 0x0 ? "mini" : "block";
+	if(ft == ptx && n >= 4)
 	{
-		std::ifstream _fib(origPath, std::ios::binary);
-		std::ofstream _fob(fn, std::ios::binary);
-		_fob << _fib.rdbuf();
-		_fob.close();
-		_fib.close();
+		uint32_t count;
+		memcpy(&count, f, sizeof(count));
+		return std::to_string(count) + " entries";
 	}
+	return "";
+}
 
-	if(tim2.size() % 2048 != 0)
+// Looks at the header offsets (0, 2 for compressed, 0x800 for PTX) of the
+// first n bytes of a fsize byte file. Only when none match is a bounded
+// prefix scanned, for compressed PTX. Compressed data is decoded as far as
+// SNIFF_SIZE, never in full.
+typeProbe probeFileType(const char* f, size_t n, size_t fsize)
+{
+	typeProbe p;
+	p.type = plainFileType(f, n, fsize);
+	if(p.type != unk)
 	{
-		size_t old = tim2.size();
-		size_t newsize = (old + 2047) & ~2047;
-		tim2.resize(newsize);
+		p.layout = describeLayout(p.type, f, n);
+		return p;
 	}
-	std::ofstream f(origPath, std::ios::binary);
-	f.write(tim2.data(), tim2.size());
-	f.close();
-	
 
+	bool atHeader = looksCompressed(f, n);
+	if(!atHeader && (fsize <= (2048 + 512) || scanMagic(f, std::min<size_t>(n, SNIFF_READ)) == std::min<size_t>(n, SNIFF_READ)))
+		return p;
+
+	std::vector<char> head(SNIFF_SIZE);
+	decompressStream ds(reinterpret_cast<const int16_t*>(f), n);
+	size_t hn = ds.read(reinterpret_cast<int16_t*>(head.data()), SNIFF_SIZE / sizeof(int16_t)) * sizeof(int16_t);
+	if(ds.failed)
+		return p;
+	// a short read of the whole file means all of it is in head
+	size_t dsize = (hn < SNIFF_SIZE && n == fsize) ? hn : SIZE_MAX;
+	p.type = plainFileType(head.data(), hn, dsize);
+	if(p.type == unk)
+		return p;
+	p.compressed = true;
+	p.layout = describeLayout(p.type, head.data(), hn);
+	return p;
+}
+
+// Type of data the caller doesn't own. When it is compressed f is pointed
+// at a new, decompressed buffer it shares.
+fileType findFileType(byteView& f, typeProbe* probe = nullptr)
+{
+	typeProbe p = probeFileType(f.data, f.size, f.size);
+	if(probe)
+		*probe = p;
+	if(!p.compressed)
+		return p.type;
+
+	auto storage = std::make_shared<std::vector<char>>();
+	if(decompressBuffer(f, *storage) == 0)
+		return unk;
+	f = byteView(std::shared_ptr<const std::vector<char>>(std::move(storage)));
+	return p.type;
 }
 
-void tim2Unpack(std::vector<char>& buffer, const char* dirname, std::filesystem::path basename, bool isc)
+// Type of a file from its first SNIFF_READ bytes, without loading or
+// inflating all of it
+fileType findFileType(const char* path)
 {
-	std::istringstream f(std::string(buffer.begin(), buffer.end()), std::ios::binary);
+	std::ifstream f(path, std::ios::binary | std::ios::ate);
+	size_t fsize = f.tellg();
 	f.seekg(0, std::ios::beg);
-	Tim2Header t2header;
-	Tim2PicHeader t2pic;
-	f.read(reinterpret_cast<char*>(&t2header), sizeof(t2header));
-	if(t2header.formatId != 0x0)
-		f.seekg(0x80, std::ios::beg);
-	f.read(reinterpret_cast<char*>(&t2pic), sizeof(t2pic));
-	f.seekg(t2pic.headerSize - sizeof(t2pic), std::ios::cur);
-	size_t pos = f.tellg();
-	char ddsMagic[4] = {'D', 'D', 'S', ' '};
-	char* texture = new char[t2pic.imgSize];
-	f.read(texture, t2pic.imgSize);
+	std::vector<char> buff(std::min<size_t>(fsize, SNIFF_READ));
+	f.read(buff.data(), buff.size());
+	f.close();
+	return probeFileType(buff.data(), buff.size(), fsize).type;
+}
 
-	if(memcmp(texture, ddsMagic, 4) != 0)
+#define PCOPY_SIZE (1024 * 1024)
+
+// Output of a packer. Bytes go straight to the file, or through a
+// compressStream when the asset is stored compressed, so neither the
+// archive nor its packed form has to be built in memory. They go to
+// path.tmp, commit() moves it over path once finish() saw every byte
+// written; otherwise the temporary is removed and path stays as it was.
+class packWriter
+{
+public:
+	packWriter(const std::string& path, bool isc, const compressOptions& copts) : target(path), tmp(path + ".tmp")
 	{
-		printErr("Supported only PC format of DMC2 textures");
-		exit(-1);
+		out = fopen(tmp.c_str(), "wb");
+		if(!out)
+			fail();
+		if(isc)
+			cs.reset(new compressStream(copts, [this](const char* d, size_t n) { put(d, n); }));
 	}
-	if(!std::filesystem::is_directory(dirname))
+
+	~packWriter()
 	{
-		if(std::filesystem::create_directory(dirname))
-		{
-			printf("-- Directory \"%s\" created\n", dirname);
-		}
+		if(out)
+			fclose(out);
+		if(!committed)
+			std::filesystem::remove(tmp, ec);
 	}
-	char* tn = new char[strlen(dirname) + strlen(basename.string().c_str()) + 6];
-	sprintf(tn, "%s/%s.dds", dirname, basename.string().c_str());
-	printf("-- Writing texture to \"%s\"\n", tn);
-	std::ofstream dds(tn, std::ios::binary);
-	dds.write(texture, t2pic.imgSize);
-	dds.close();
-	delete [] tn;
-
 
-	// for ex. item0.biz is compressed tim2, so... needed (also filename)
-	char* _metan = new char[strlen(dirname) + 12];
-	sprintf(_metan, "%s/.metadata", dirname);
-	std::vector<std::string> _meta;
-	_meta.push_back(basename.string());
-	if(isc)
-		_meta.push_back("_compressed");
-	printf("-- Creating \"%s/.metadata\" file\n", dirname);
-	std::ofstream _metadata(_metan, std::ios::out);
-	for(const auto e : _meta)
+	bool is_open() const
 	{
-		_metadata << e << '\n';
+		return out != nullptr;
 	}
-	delete [] _metan;
-	_metadata.close();
 
-	// dump a header or data to texture point
-
-	// sprintf(tc, "%s/.meta.%s", dirname, basename.string().c_str());
-	std::filesystem::path tc = dirname;
-	tc = tc.append(".meta." + basename.string());
-	std::ofstream metadata(tc, std::ios::binary);
-	f.seekg(0, std::ios::beg);
-	char* _r = new char[pos];
-	f.read(_r, pos);
-	metadata.write(_r, pos);
-	delete [] _r;
-	metadata.close();
+	void write(const char* d, size_t n)
+	{
+		pos += n;
+		if(cs)
+			cs->write(d, n);
+		else
+			put(d, n);
+	}
 
-}
+	void zeros(size_t n)
+	{
+		static const char z[64] = {};
+		for(; n > sizeof(z); n -= sizeof(z))
+			write(z, sizeof(z));
+		write(z, n);
+	}
 
-void ptxPack(std::string dirname, std::string metadataFile, std::string origPath)
-{
-	bool isc = false;
-	std::string basename, line;
-	std::filesystem::path _tp = dirname;
-	std::vector<std::string> files;
+	// Copies exactly size bytes of path, zero-filled if it got shorter
+	// since it was measured. Uncompressed output is copied by the kernel
+	// where the filesystem allows it, the bytes never enter user space.
+	void copyFile(const std::string& path, size_t size)
+	{
+		size_t left = size;
+		std::ifstream in;
+		if(!cs && kernelCopy && !failed)
+			left -= copyKernel(path, size);
+		if(left > 0)
+		{
+			in.open(path, std::ios::binary);
+			in.seekg(size - left, std::ios::beg);
+		}
+		std::vector<char> chunk(std::min<size_t>(left, PCOPY_SIZE));
+		while(left > 0 && in && !failed)
+		{
+			in.read(chunk.data(), std::min(left, chunk.size()));
+			write(chunk.data(), in.gcount());
+			left -= in.gcount();
+		}
+		if(left > 0 && !failed)
+		{
+			printErr("\"%s\" is shorter than expected", path.c_str());
+			zeros(left);
+		}
+	}
 
-	std::ifstream meta(metadataFile);
-	std::getline(meta, basename);
+	size_t tell() const
+	{
+		return pos;
+	}
 
-	while(std::getline(meta, line))
+	// Allocates the whole uncompressed output up front so it isn't grown
+	// (and fragmented) a write at a time. Filesystems that can't are fine,
+	// running out of space or over the file size limit is not.
+	void reserve(size_t size)
 	{
-		if(line.find("_compressed") != std::string::npos)
+#ifdef __linux__
+		if(!cs && size > 0 && out)
 		{
-			isc = true;
-			continue;
+			fflush(out);
+			int e = posix_fallocate(fileno(out), 0, size);
+			if(e != 0 && e != EOPNOTSUPP && e != EINVAL && e != ENOSYS)
+				fail(e);
 		}
-		if(line == "") break;
-		std::filesystem::path p = _tp;
-		p.append("_" + line);
-		if(std::filesystem::is_directory(p))
-			pack(p.string().c_str());
-		_tp = _tp.append(line);
-		files.push_back(_tp.string());
-		_tp = dirname;
+#else
+		(void)size;
+#endif
+	}
 
+	// Flushes and closes the output, false if any of it didn't make it
+	bool finish()
+	{
+		written = cs ? cs->finish() : pos;
+		if(out)
+		{
+			if(fflush(out) != 0 || ferror(out))
+				fail();
+			if(fclose(out) != 0)
+				fail();
+			out = nullptr;
+		}
+		return !failed;
 	}
-	meta.close();
 
-	std::string fn = origPath + ".bak";
-	if(!std::filesystem::exists(fn))
+	// Puts the finished output in place of the original
+	bool commit()
 	{
-		std::ifstream _fib(origPath, std::ios::binary);
-		std::ofstream _fob(fn, std::ios::binary);
-		_fob << _fib.rdbuf();
-		_fob.close();
-		_fib.close();
+		if(failed || out)
+			return false;
+		std::filesystem::rename(tmp, target, ec);
+		if(ec)
+		{
+			err = ec.message();
+			return false;
+		}
+		committed = true;
+		return true;
 	}
 
-	std::ostringstream f(std::ios::binary);
+	// size of the file written, compressed when it is
+	size_t size() const
+	{
+		return written;
+	}
 
-	std::vector<char> zeros(0x800, 0);
-	f.write(zeros.data(), zeros.size());
+	std::string error() const
+	{
+		return target + ": " + err;
+	}
 
-	f.seekp(0, std::ios::beg);
-	uint32_t count = files.size();
-	f.write(reinterpret_cast<char*>(&count), sizeof(uint32_t));
+private:
+	std::string target;
+	std::string tmp;
+	FILE* out = nullptr;
+	std::unique_ptr<compressStream> cs;
+	size_t pos = 0;
+	size_t written = 0;
+	bool kernelCopy = true;
+	bool failed = false;
+	bool committed = false;
+	std::string err;
+	std::error_code ec;
+
+	void fail(int e = errno)
+	{
+		if(!failed)
+			err = strerror(e);
+		failed = true;
+	}
 
-	f.seekp(0x800, std::ios::beg);
+	void put(const char* d, size_t n)
+	{
+		if(!failed && fwrite(d, 1, n, out) != n)
+			fail();
+	}
 
-	std::streampos p;
-	for(size_t i = 0; i < files.size(); i++)
+#ifdef __linux__
+	// copy_file_range straight into the output. Returns how much it got
+	// through; on filesystems (or kernels) that can't do it, turns itself
+	// off and leaves the rest to the buffered copy.
+	size_t copyKernel(const std::string& path, size_t size)
 	{
-		
-		printf("-- Writing \"%s\"\n", files[i].c_str());
-		std::ifstream _t(files[i], std::ios::binary | std::ios::ate);
-		size_t fsize = _t.tellg();
+		int src = ::open(path.c_str(), O_RDONLY);
+		if(src < 0)
+			return 0;
+		fflush(out);
+		int dst = fileno(out);
+		size_t done = 0;
+		while(done < size)
+		{
+			ssize_t n = copy_file_range(src, nullptr, dst, nullptr, size - done, 0);
+			if(n <= 0)
+			{
+				// EXDEV and the like before anything was copied mean it
+				// isn't supported here, anything else is a failed write
+				if(n < 0 && done == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+					kernelCopy = false;
+				else if(n < 0)
+					fail();
+				break;
+			}
+			done += n;
+		}
+		close(src);
+		pos += done;
+		// the fd moved under the FILE, put them back in step
+		fseeko(out, pos, SEEK_SET);
+		return done;
+	}
+#else
+	size_t copyKernel(const std::string&, size_t)
+	{
+		kernelCopy = false;
+		return 0;
+	}
+#endif
+};
+
+// Clones src to dst by sharing extents (btrfs, XFS), nothing is copied
+bool cloneFile(const std::string& src, const std::string& dst)
+{
+#if defined(__linux__) && defined(FICLONE)
+	int in = ::open(src.c_str(), O_RDONLY);
+	if(in < 0)
+		return false;
+	int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out < 0)
+	{
+		close(in);
+		return false;
+	}
+	bool ok = ioctl(out, FICLONE, in) == 0;
+	close(in);
+	close(out);
+	if(!ok)
+		std::filesystem::remove(dst);
+	return ok;
+#else
+	(void)src;
+	(void)dst;
+	return false;
+#endif
+}
+
+// Reads path through the hash, copying it to dst on the way when given
+bool hashFile(const std::string& path, uint64_t& hash, size_t& size, const std::string& dst = "")
+{
+	std::ifstream in(path, std::ios::binary);
+	if(!in.is_open())
+		return false;
+	std::ofstream out;
+	if(!dst.empty())
+	{
+		out.open(dst, std::ios::binary);
+		if(!out.is_open())
+			return false;
+	}
+	hash64 h;
+	std::vector<char> chunk(PCOPY_SIZE);
+	size = 0;
+	while(in)
+	{
+		in.read(chunk.data(), chunk.size());
+		size_t n = in.gcount();
+		h.update(chunk.data(), n);
+		if(out.is_open())
+			out.write(chunk.data(), n);
+		size += n;
+	}
+	hash = h.digest();
+	return !out.is_open() || out.good();
+}
+
+// Makes origPath.bak the first time a file is packed, as a clone where the
+// filesystem can and a copy otherwise. The original's size and hash go to
+// origPath.bak.sum so later runs can check the backup without rereading it.
+// A clone doesn't read the original; its hash comes from source, the stamp
+// extraction recorded, when the file still has that size and mtime. The
+// backup is made aside and moved in with its .sum written, so a .bak is
+// never partial. False when there is no backup to fall back on.
+bool backupFile(const std::string& origPath, const fileStamp& source = fileStamp())
+{
+	std::string fn = origPath + ".bak";
+	std::string sum = fn + ".sum";
+	std::error_code ec;
+	if(std::filesystem::exists(fn))
+	{
+		std::ifstream s(sum);
+		size_t size;
+		std::string hex;
+		if(!(s >> size >> hex) || hex.size() != 16)
+			printErr("Backup \"%s\" can't be checked, \"%s\" is missing or broken", fn.c_str(), sum.c_str());
+		else if(std::filesystem::file_size(fn, ec) != size || ec)
+			printErr("Backup \"%s\" doesn't match the size recorded in \"%s\"", fn.c_str(), sum.c_str());
+		return true;
+	}
+
+	std::string tmp = fn + ".tmp";
+	uint64_t hash;
+	size_t size;
+	bool ok;
+	if(cloneFile(origPath, tmp))
+	{
+		size = std::filesystem::file_size(origPath, ec);
+		ok = !ec;
+		if(ok && source.known && size == source.size && fileTime(origPath) == source.mtime)
+			hash = source.hash;
+		else if(ok)
+			ok = hashFile(origPath, hash, size);
+	}
+	else
+		ok = hashFile(origPath, hash, size, tmp);
+	if(ok)
+	{
+		std::ofstream s(sum);
+		s << size << ' ' << hashHex(hash) << '\n';
+		ok = s.good();
+		s.close();
+	}
+	if(ok)
+		std::filesystem::rename(tmp, fn, ec);
+	if(!ok || ec)
+	{
+		printErr("Cannot back up \"%s\"", origPath.c_str());
+		std::filesystem::remove(tmp, ec);
+		std::filesystem::remove(sum, ec);
+		return false;
+	}
+	return true;
+}
+
+struct ipumHeader
+{
+	char magic[4];
+	uint32_t unk1;
+	uint32_t unk2;
+	uint32_t frameCount;
+	uint32_t framerate;
+};
+
+bool ipumPack(std::string dirname, std::string metadataFile, std::string origPath, const packOptions& opts)
+{
+	// header aka .meta.your.ipu
+	// dds size
+	// dds data
+	// frame end aka frame0.meta
+	metaInfo meta;
+	readMetadata(metadataFile, meta);
+	bool isc = meta.compressed;
+	std::string basename = meta.basename;
+	std::filesystem::path _tp = dirname;
+	std::vector<std::string> files;
+
+	for(const fileStamp& e : meta.entries)
+	{
+		_tp = _tp.append(e.name);
+		files.push_back(_tp.string());
+		_tp = dirname;
+	}
+
+	if(!backupFile(origPath, meta.source))
+		return false;
+
+	std::ostringstream f(std::ios::binary);
+
+	_tp = _tp.append(".meta." + basename);
+	std::ifstream ipuHeader(_tp.string(), std::ios::binary);
+	f << ipuHeader.rdbuf();
+	ipuHeader.close();
+
+
+	for(size_t i = 0; i < files.size(); i++)
+	{	
+		printf("-- Writing \"%s\"\n", files[i].c_str());
+		std::ifstream _t(files[i], std::ios::binary | std::ios::ate);
+		size_t fsize = _t.tellg();
 		_t.seekg(0, std::ios::beg);
 		printf("   Size: %lu\n", fsize);
+		f << "frmj";
+		f.write(reinterpret_cast<char*>(&fsize), sizeof(uint32_t));
+		f << _t.rdbuf();
+		_t.close();
+		std::string ddsMeta = files[i].erase(files[i].size() - 3) + "meta";
+		_t.open(ddsMeta, std::ios::binary);
+		_t.seekg(0, std::ios::beg);
+		f.seekp(-4, std::ios::cur);
 		f << _t.rdbuf();
-		p = f.tellp();
-		f.seekp(i * sizeof(uint32_t) + sizeof(uint32_t), std::ios::beg);
-		uint32_t ptxSize = fsize / 2048;
-		f.write(reinterpret_cast<char*>(&ptxSize), sizeof(uint32_t));
-		f.seekp(p);
 		_t.close();
 	}
 
@@ -763,496 +1429,2176 @@ void ptxPack(std::string dirname, std::string metadataFile, std::string origPath
 		printf("-- Compressing file\n");
 		size_t _size = buff.size();
 		std::vector<char> out(_size / 2);
-		size_t csize = compress(buff, out);
+		size_t csize = compress(buff, out, opts.copts);
 		out.resize(csize);
 
-		buff = std::move(out);
-	}
-	std::ofstream _f(origPath, std::ios::binary);
-	_f.write(buff.data(), buff.size());
-	_f.close();
+		buff = std::move(out);
+	}
+	packWriter _f(origPath, false, opts.copts);
+	_f.write(buff.data(), buff.size());
+	if(!_f.finish() || !_f.commit())
+	{
+		printErr("Failed to write %s", _f.error().c_str());
+		return false;
+	}
+	return true;
+}
+
+bool ipumUnpack(byteView buffer, const char* dirname, const fileStamp& source, bool isc, writeQueue& out)
+{
+	std::filesystem::path basename = source.name;
+	byteReader f(buffer);
+	ipumHeader ipu;
+	if(!f.read(ipu))
+	{
+		printErr("Broken IPU header");
+		return false;
+	}
+	printf("-- Ipum frame count: %i\n", ipu.frameCount);
+	bool ok = true;
+	if(!std::filesystem::is_directory(dirname))
+	{
+		if(std::filesystem::create_directory(dirname))
+		{
+			printf("-- Directory \"%s\" created\n", dirname);
+		}
+	}
+
+	metaInfo _meta;
+	_meta.basename = basename.string();
+	_meta.compressed = isc;
+	_meta.type = fileType::ipu;
+	_meta.source = source;
+
+	// sprintf(tc, "%s/.meta.%s", dirname, basename.string().c_str());
+	std::filesystem::path tc = dirname;
+	tc = tc.append(".meta." + basename.string());
+	out.push(tc.string(), buffer.sub(0, sizeof(ipu)));
+	_meta.parts.push_back(stampOf(".meta." + basename.string(), buffer.sub(0, sizeof(ipu))));
+
+	for(uint32_t i = 0; i < ipu.frameCount; i++)
+	{
+		char frameStart[4];
+		uint32_t tSize;
+		f.read(frameStart);
+		f.read(tSize);
+		// frame data, the last 4 bytes are the frame end
+		byteView texture = f.take(tSize);
+		if(f.failed || tSize < 4)
+		{
+			printErr("Frame %u is out of bounds", i);
+			ok = false;
+			break;
+		}
+		char* tn = new char[strlen(dirname) + sizeof(uint32_t) + 12];
+		sprintf(tn, "%s/frame%i.dds", dirname, i);
+		_meta.entries.push_back(stampOf("frame" + std::to_string(i) + ".dds", texture));
+		_meta.parts.push_back(stampOf("frame" + std::to_string(i) + ".meta", texture.sub(tSize - 4, 4)));
+		char* tnm = new char[strlen(dirname) + sizeof(uint32_t) + 12 + 1];
+		sprintf(tnm, "%s/frame%i.meta", dirname, i);
+		printf("-- Writing texture to \"%s\"\n", tn);
+		out.push(tnm, texture.sub(tSize - 4, 4));
+		out.push(tn, texture);
+		delete [] tnm;
+		delete [] tn;
+	}
+
+	queueMetadata(out, dirname, _meta);
+	return ok;
+}
+struct Tim2Header
+{
+	char magic[4];
+	char formatVer;
+	char formatId;
+	uint16_t count;
+	// char pad[8];
+	// Maybe:
+	uint32_t texOff;
+	uint32_t texSize;
+	//
+};
+
+struct GsTex {
+	unsigned long TBP0 : 14;
+	unsigned long TBW : 6;
+	unsigned long PSM : 6;
+	unsigned long TW : 4;
+	unsigned long TH : 4;
+	unsigned long TCC : 1;
+	unsigned long TFX : 2;
+	unsigned long CBP : 14;
+	unsigned long CPSM : 4;
+	unsigned long CSM : 1;
+	unsigned long CSA : 5;
+	unsigned long CLD : 3;
+};
+
+struct Tim2PicHeader
+{
+	uint32_t totalSize;
+	uint32_t clutSize;
+	uint32_t imgSize;
+	uint16_t headerSize;
+	uint16_t clutColors;
+	char picFormat;
+	char MipMapTextures;
+	char clutType;
+	char ImageType;
+	uint16_t ImageWidth;
+	uint16_t ImageHeight;
+
+	GsTex GsTex0;
+	GsTex GsTex1;
+	uint32_t GsTexaFbaPabe;
+	uint32_t GsTexClut;
+};
+
+bool tim2Pack(std::string dirname, std::string metadataFile, std::string origPath, const packOptions& opts)
+{
+	metaInfo meta;
+	readMetadata(metadataFile, meta);
+	std::string basename = meta.basename;
+	bool isc = meta.compressed;
+
+	std::filesystem::path texFile = dirname;
+	texFile = texFile.append(basename + ".dds");
+	std::filesystem::path texMetaFile = dirname;
+	texMetaFile = texMetaFile.append(".meta." + basename);
+
+	std::vector<char> tim2;
+
+	std::ifstream _tim2(texMetaFile, std::ios::binary);
+	if(!_tim2.is_open())
+	{
+		printErr("Cannot open \"%s\"", texMetaFile.string().c_str());
+		return false;
+	}
+	Tim2Header t2header;
+	Tim2PicHeader t2pic;
+	_tim2.seekg(0, std::ios::end);
+	size_t ts = _tim2.tellg();
+	_tim2.seekg(0, std::ios::beg);
+	_tim2.read(reinterpret_cast<char*>(&t2header), sizeof(t2header));
+	std::vector<char> addData;
+	std::vector<char> addData2;
+	if(t2header.formatId != 0x0)
+	{
+		addData.resize(128 - _tim2.tellg());
+		_tim2.read(addData.data(), addData.size());
+	}
+	_tim2.read(reinterpret_cast<char*>(&t2pic), sizeof(t2pic));
+	size_t s = _tim2.tellg();
+	if(ts > s)
+	{
+		addData2.resize(ts-s);
+		_tim2.read(addData2.data(), (ts - s));
+	}
+	size_t hS = _tim2.tellg();
+	_tim2.close();
+
+
+	std::ifstream _dds(texFile, std::ios::binary | std::ios::ate);
+	if(!_dds.is_open())
+	{
+		printErr("Cannot open \"%s\"", texFile.string().c_str());
+		return false;
+	}
+	size_t ddsSize = _dds.tellg();
+
+	_dds.seekg(12, std::ios::beg);
+	uint32_t w, h;
+	_dds.read(reinterpret_cast<char*>(&w), sizeof(uint32_t));
+	_dds.read(reinterpret_cast<char*>(&h), sizeof(uint32_t));
+	_dds.seekg(0, std::ios::beg);
+
+	std::vector<char> ddsData(ddsSize);
+	_dds.read(ddsData.data(), ddsData.size());
+
+	/// :( don't works....
+	// GsTex tex = t2pic.GsTex0;
+	// t2header.texSize = ddsSize;
+	// t2pic.ImageWidth = w;
+	// t2pic.ImageHeight = h;
+	//
+	// tex.TW = log2(w);
+	// tex.TH = log2(h);
+	//
+	// t2pic.GsTex0 = tex;
+
+	t2pic.imgSize = ddsSize;
+	t2pic.totalSize = ddsSize + hS - t2pic.headerSize;
+
+
+	tim2.insert(tim2.end(), reinterpret_cast<char*>(&t2header), reinterpret_cast<char*>(&t2header) + sizeof(t2header));
+	if(t2header.formatId != 0x0)
+	{
+		tim2.insert(tim2.end(), addData.begin(), addData.end());
+	}
+	tim2.insert(tim2.end(), reinterpret_cast<char*>(&t2pic), reinterpret_cast<char*>(&t2pic) + sizeof(t2pic));
+	if(addData2.size() != 0)
+		tim2.insert(tim2.end(), addData2.begin(), addData2.end());
+	tim2.insert(tim2.end(), ddsData.begin(), ddsData.end());
+	_dds.close();
+
+	if(isc)
+	{
+		std::vector<char> out(tim2.size());
+		size_t csize = compress(tim2, out, opts.copts);
+		out.resize(csize);
+
+		tim2 = std::move(out);
+	}
+
+	if(!backupFile(origPath, meta.source))
+		return false;
+
+	if(tim2.size() % 2048 != 0)
+	{
+		size_t old = tim2.size();
+		size_t newsize = (old + 2047) & ~2047;
+		tim2.resize(newsize);
+	}
+	packWriter f(origPath, false, opts.copts);
+	f.write(tim2.data(), tim2.size());
+	if(!f.finish() || !f.commit())
+	{
+		printErr("Failed to write %s", f.error().c_str());
+		return false;
+	}
+	return true;
+}
+
+// The picture data of a TIM2 and where the headers before it end
+bool tim2Texture(byteView buffer, byteView& texture, size_t& pos)
+{
+	byteReader f(buffer);
+	Tim2Header t2header;
+	Tim2PicHeader t2pic;
+	f.read(t2header);
+	if(t2header.formatId != 0x0)
+		f.seek(0x80);
+	f.read(t2pic);
+	f.skip(t2pic.headerSize - sizeof(t2pic));
+	pos = f.pos;
+	texture = f.take(t2pic.imgSize);
+	return !f.failed;
+}
+
+bool tim2Unpack(byteView buffer, const char* dirname, const fileStamp& source, bool isc, writeQueue& out)
+{
+	std::filesystem::path basename = source.name;
+	size_t pos;
+	char ddsMagic[4] = {'D', 'D', 'S', ' '};
+	byteView texture;
+	if(!tim2Texture(buffer, texture, pos))
+	{
+		printErr("Broken TIM2 file");
+		return false;
+	}
+
+	if(texture.size < 4 || memcmp(texture.data, ddsMagic, 4) != 0)
+	{
+		printErr("Supported only PC format of DMC2 textures");
+		return false;
+	}
+	if(!std::filesystem::is_directory(dirname))
+	{
+		if(std::filesystem::create_directory(dirname))
+		{
+			printf("-- Directory \"%s\" created\n", dirname);
+		}
+	}
+	char* tn = new char[strlen(dirname) + strlen(basename.string().c_str()) + 6];
+	sprintf(tn, "%s/%s.dds", dirname, basename.string().c_str());
+	printf("-- Writing texture to \"%s\"\n", tn);
+	out.push(tn, texture);
+	delete [] tn;
+
+
+	// dump a header or data to texture point
+
+	// sprintf(tc, "%s/.meta.%s", dirname, basename.string().c_str());
+	std::filesystem::path tc = dirname;
+	tc = tc.append(".meta." + basename.string());
+	out.push(tc.string(), buffer.sub(0, pos));
+
+	// for ex. item0.biz is compressed tim2, so... needed (also filename)
+	metaInfo _meta;
+	_meta.basename = basename.string();
+	_meta.compressed = isc;
+	_meta.type = tim2;
+	_meta.source = source;
+	_meta.parts.push_back(stampOf(basename.string() + ".dds", texture));
+	_meta.parts.push_back(stampOf(".meta." + basename.string(), buffer.sub(0, pos)));
+	queueMetadata(out, dirname, _meta);
+	return true;
+}
+
+bool ptxPack(std::string dirname, std::string metadataFile, std::string origPath, const packOptions& opts)
+{
+	metaInfo meta;
+	readMetadata(metadataFile, meta);
+	bool isc = meta.compressed;
+	std::filesystem::path _tp = dirname;
+	std::vector<std::string> files;
+
+	for(const fileStamp& e : meta.entries)
+	{
+		std::filesystem::path p = _tp;
+		p.append("_" + e.name);
+		if(std::filesystem::is_directory(p) && !pack(p.string().c_str(), opts))
+			return false;
+		_tp = _tp.append(e.name);
+		files.push_back(_tp.string());
+		_tp = dirname;
+	}
+
+	if(!backupFile(origPath, meta.source))
+		return false;
+
+	// 0x800 header: count and a size / 2048 per entry, then the entries
+	std::vector<char> header(0x800, 0);
+	uint32_t count = files.size();
+	if(sizeof(uint32_t) * (count + 1) > header.size())
+	{
+		printErr("Too many entries for a PTX header (%u)", count);
+		return false;
+	}
+	memcpy(header.data(), &count, sizeof(uint32_t));
+
+	std::vector<size_t> sizes(files.size());
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		std::error_code ec;
+		sizes[i] = std::filesystem::file_size(files[i], ec);
+		if(ec)
+		{
+			printErr("Cannot read \"%s\"", files[i].c_str());
+			return false;
+		}
+		uint32_t ptxSize = sizes[i] / 2048;
+		memcpy(header.data() + i * sizeof(uint32_t) + sizeof(uint32_t), &ptxSize, sizeof(uint32_t));
+	}
+
+	if(isc)
+		printf("-- Compressing file\n");
+	packWriter f(origPath, isc, opts.copts);
+	if(!f.is_open())
+	{
+		printErr("Cannot write %s", f.error().c_str());
+		return false;
+	}
+	size_t total = header.size();
+	for(size_t s : sizes)
+		total += s;
+	f.reserve(total);
+	f.write(header.data(), header.size());
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		printf("-- Writing \"%s\"\n", files[i].c_str());
+		printf("   Size: %lu\n", sizes[i]);
+		f.copyFile(files[i], sizes[i]);
+	}
+	if(!f.finish() || !f.commit())
+	{
+		printErr("Failed to write %s", f.error().c_str());
+		return false;
+	}
+	return true;
+}
+
+bool ptxUnpack(byteView buffer, const char* dirname, const fileStamp& source, bool isc, taskPool& pool, writeQueue& out)
+{
+	byteReader f(buffer);
+	uint32_t count;
+	f.read(count);
+	if(count > f.remaining() / sizeof(uint32_t))
+	{
+		printErr("Broken PTX table");
+		return false;
+	}
+	std::vector<uint32_t> align(count); // tim2 size / 2048
+	for(size_t i = 0; i < count; i++)
+		f.read(align[i]);
+	if(!std::filesystem::is_directory(dirname))
+	{
+		if(std::filesystem::create_directory(dirname))
+		{
+			printf("-- Directory \"%s\" created\n", dirname);
+		}
+	}
+
+
+	metaInfo meta;
+	meta.basename = source.name;
+	meta.compressed = isc;
+	meta.type = ptx;
+	meta.align = 2048;
+	meta.source = source;
+
+	std::vector<fileStamp> stamps(count);
+	std::atomic<bool> ok{true};
+	taskGroup group;
+	size_t o = 0x800;
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t s = align[i] * 2048;
+
+		pool.submit(group, [buffer, &stamps, &ok, &out, dirname, i, o, s] {
+			char* ufn = new char[6 + strlen(dirname) + 1 + 3 + 20];
+			// a short last entry reads as zeros, only that one gets copied
+			byteView raw;
+			if(buffer.contains(o, s))
+				raw = buffer.sub(o, s);
+			else
+			{
+				auto padded = std::make_shared<std::vector<char>>(s);
+				if(o < buffer.size)
+					memcpy(padded->data(), buffer.data + o, buffer.size - o);
+				raw = byteView(std::shared_ptr<const std::vector<char>>(std::move(padded)));
+			}
+
+			byteView entry = raw;
+			fileType ft = findFileType(entry);
+			sprintf(ufn, "%s/id%lu.%s", dirname, i, fileTypeExt(ft));
+			printf("-- Writing to \"%s\", size: %lu\n", ufn, s);
+			out.push(ufn, raw);
+
+			std::filesystem::path ap = std::filesystem::absolute(ufn);
+			std::filesystem::path bn = ap.filename();
+			std::filesystem::path dn = ap.parent_path() / ("_" + bn.string());
+			stamps[i] = stampOf(bn.string(), raw);
+			stamps[i].offset = o;
+			stamps[i].placed = true;
+			
+			switch (ft) {
+				case tim2:
+					if(!tim2Unpack(entry, dn.string().c_str(), stamps[i], entry.data != raw.data, out))
+						ok = false;
+					break;
+				default:
+					break;
+			}
+
+			delete [] ufn;
+		});
+		o += s;
+	}
+	pool.wait(group);
+	meta.entries = std::move(stamps);
+	queueMetadata(out, dirname, meta);
+	return ok;
+}
+
+
+struct blockM
+{
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct miniBlock
+{
+	uint32_t offset;
+	uint32_t size;
+};
+
+// Offset/size table of a MOMO in either layout, widened to blockM rows.
+// mb is the miniBlock layout (32 bit count and rows).
+bool readMomoTable(byteView buffer, bool& mb, std::vector<blockM>& rows)
+{
+	byteReader f(buffer);
+	char c;
+	f.seek(sizeof(uint32_t));
+	f.read(c);
+	mb = c != 0x0;
+
+	size_t count;
+	if(!mb)
+	{
+		f.seek(sizeof(uint64_t));
+		uint64_t tbc;
+		f.read(tbc);
+		count = tbc;
+	}else{
+		f.seek(sizeof(uint32_t));
+		uint32_t tbc;
+		f.read(tbc);
+		count = tbc;
+	}
+
+	if(f.failed || count > f.remaining() / (mb ? sizeof(miniBlock) : sizeof(blockM)))
+		return false;
+
+	rows.resize(count);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(!mb)
+			f.read(rows[i]);
+		else
+		{
+			miniBlock mblock;
+			f.read(mblock);
+			rows[i] = {mblock.offset, mblock.size};
+		}
+	}
+	return !f.failed;
+}
+
+// PTX sector table as offset/size rows, entries start at 0x800
+bool readPtxTable(byteView buffer, std::vector<blockM>& rows)
+{
+	byteReader f(buffer);
+	uint32_t count;
+	f.read(count);
+	if(f.failed || count > f.remaining() / sizeof(uint32_t))
+		return false;
+	size_t o = 0x800;
+	rows.resize(count);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t align;
+		f.read(align);
+		rows[i] = {o, size_t(align) * 2048};
+		o += size_t(align) * 2048;
+	}
+	return true;
+}
+
+// Entry i of an uncompressed MOMO or PTX, as extracting writes it: a
+// short last entry is padded with zeros
+bool archiveEntry(byteView data, fileType ft, size_t i, byteView& entry)
+{
+	std::vector<blockM> rows;
+	bool mb;
+	if(ft == momo ? !readMomoTable(data, mb, rows) : ft != ptx || !readPtxTable(data, rows))
+		return false;
+	if(i >= rows.size())
+		return false;
+	if(data.contains(rows[i].offset, rows[i].size))
+	{
+		entry = data.sub(rows[i].offset, rows[i].size);
+		return true;
+	}
+	auto padded = std::make_shared<std::vector<char>>(rows[i].size);
+	if(rows[i].offset < data.size)
+		memcpy(padded->data(), data.data + rows[i].offset, std::min<size_t>(rows[i].size, data.size - rows[i].offset));
+	entry = byteView(std::shared_ptr<const std::vector<char>>(std::move(padded)));
+	return true;
+}
+
+bool filesEqual(const std::string& a, const std::string& b)
+{
+	std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+	if(!fa.is_open() || !fb.is_open())
+		return false;
+	std::vector<char> ca(PCOPY_SIZE), cb(PCOPY_SIZE);
+	while(fa && fb)
+	{
+		fa.read(ca.data(), ca.size());
+		fb.read(cb.data(), cb.size());
+		if(fa.gcount() != fb.gcount() || memcmp(ca.data(), cb.data(), fa.gcount()) != 0)
+			return false;
+	}
+	return !fa && !fb;
+}
+
+// Entries whose contents already appear earlier in files, as the index of
+// that earlier one (SIZE_MAX otherwise). Only files sharing a size with
+// another are hashed, and a hash match is confirmed byte for byte.
+std::vector<size_t> findDuplicates(const std::vector<std::string>& files, const std::vector<size_t>& sizes)
+{
+	std::vector<size_t> dupOf(files.size(), SIZE_MAX);
+	std::map<size_t, size_t> sizeCount;
+	for(size_t s : sizes)
+		sizeCount[s]++;
+
+	std::map<std::pair<size_t, uint64_t>, std::vector<size_t>> seen;
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		if(sizes[i] == 0 || sizeCount[sizes[i]] < 2)
+			continue;
+		uint64_t hash;
+		size_t size;
+		if(!hashFile(files[i], hash, size) || size != sizes[i])
+			continue;
+		std::vector<size_t>& same = seen[{size, hash}];
+		for(size_t j : same)
+			if(filesEqual(files[i], files[j]))
+			{
+				dupOf[i] = j;
+				break;
+			}
+		if(dupOf[i] == SIZE_MAX)
+			same.push_back(i);
+	}
+	return dupOf;
+}
+
+// Whether the entries can go back to the offsets they were unpacked from:
+// all of them recorded, none shared, after the table and each no bigger
+// than the gap to the next one. The last can grow freely.
+bool keepsLayout(const std::vector<fileStamp>& entries, const std::vector<size_t>& sizes, size_t tableEnd)
+{
+	std::vector<size_t> starts;
+	for(const fileStamp& e : entries)
+	{
+		if(!e.placed || e.offset < tableEnd)
+			return false;
+		starts.push_back(e.offset);
+	}
+	std::sort(starts.begin(), starts.end());
+	if(std::adjacent_find(starts.begin(), starts.end()) != starts.end())
+		return false;
+	for(size_t i = 0; i < entries.size(); i++)
+	{
+		auto next = std::upper_bound(starts.begin(), starts.end(), entries[i].offset);
+		if(next != starts.end() && sizes[i] > *next - entries[i].offset)
+			return false;
+	}
+	return true;
+}
+
+// Where every entry of a MOMO archive goes and the table that says so
+struct momoLayout
+{
+	std::vector<char> header;
+	std::vector<size_t> offsets;
+	std::vector<size_t> order; // entries that get data, by offset
+	size_t end = 0;
+};
+
+// Lays a MOMO archive out: the recorded offsets when every entry still fits
+// them, one after the other otherwise. A duplicate (dupOf) gets its first
+// copy's offset and no data of its own.
+momoLayout planMomo(bool mb, size_t align, const std::vector<size_t>& sizes, const std::vector<size_t>& dupOf, const std::vector<fileStamp>& recorded)
+{
+	auto alignUp = [align](size_t v) { return (v + align - 1) / align * align; };
+	size_t bcount = mb ? sizeof(uint32_t) : sizeof(uint64_t);
+	bool dups = std::any_of(dupOf.begin(), dupOf.end(), [](size_t d) { return d != SIZE_MAX; });
+
+	momoLayout l;
+	l.offsets.resize(sizes.size());
+	size_t tableEnd = alignUp(bcount * 2 + (bcount * 2) * sizes.size());
+	l.end = tableEnd;
+	if(!dups && keepsLayout(recorded, sizes, tableEnd))
+	{
+		// every entry still fits where the original had it
+		for(size_t i = 0; i < sizes.size(); i++)
+		{
+			l.offsets[i] = recorded[i].offset;
+			l.end = std::max(l.end, alignUp(l.offsets[i] + sizes[i]));
+		}
+	}
+	else
+	{
+		for(size_t i = 0; i < sizes.size(); i++)
+		{
+			if(dupOf[i] != SIZE_MAX)
+			{
+				l.offsets[i] = l.offsets[dupOf[i]];
+				continue;
+			}
+			l.offsets[i] = l.end;
+			l.end = alignUp(l.end + sizes[i]);
+		}
+	}
+
+	l.header.resize(tableEnd, 0);
+	memcpy(l.header.data(), momoMagic, 4);
+	size_t tmp = sizes.size();
+	memcpy(l.header.data() + bcount, &tmp, bcount);
+	for(size_t i = 0; i < sizes.size(); i++)
+	{
+		memcpy(l.header.data() + (bcount * 2) + (bcount * 2) * i, &l.offsets[i], bcount);
+		memcpy(l.header.data() + (bcount * 2) + (bcount * 2) * i + bcount, &sizes[i], bcount);
+		if(dupOf[i] == SIZE_MAX)
+			l.order.push_back(i);
+	}
+	std::stable_sort(l.order.begin(), l.order.end(), [&](size_t a, size_t b) { return l.offsets[a] < l.offsets[b]; });
+	return l;
+}
+
+// Writes a planned archive, entry(i) writing the data of entry i; the gaps
+// between entries are zero filled
+void writeMomo(packWriter& f, const momoLayout& l, const std::function<void(size_t)>& entry)
+{
+	f.reserve(l.end);
+	f.write(l.header.data(), l.header.size());
+	for(size_t i : l.order)
+	{
+		f.zeros(l.offsets[i] - f.tell());
+		entry(i);
+	}
+	f.zeros(l.end - f.tell());
+}
+
+bool momoPack(std::string dirname, std::string metadataFile, std::string origPath, const packOptions& opts)
+{
+	metaInfo meta;
+	readMetadata(metadataFile, meta);
+
+	// .metadata from before _layout: guess it from the original's header
+	bool mb = meta.layout == "mini";
+	if(meta.layout.empty())
+	{
+		std::ifstream _m(origPath, std::ios::binary);
+		char c;
+		_m.seekg(sizeof(uint32_t));
+		_m.read(&c, 1);
+		if(c == 'M' || c == 'O')
+		{
+			_m.seekg(sizeof(uint32_t) + 2);
+			_m.read(&c, 1);
+		}
+		if(c != 0x0)
+			mb = true;
+		_m.close();
+	}
+	bool isc = meta.compressed;
+	std::vector<std::string> files;
+	std::filesystem::path _tp = dirname;
+	for(const fileStamp& e : meta.entries)
+	{
+		std::filesystem::path p = _tp;
+		p.append("_" + e.name);
+		if(std::filesystem::is_directory(p) && !pack(p.string().c_str(), opts))
+			return false;
+		_tp = _tp.append(e.name);
+		files.push_back(_tp.string());
+		_tp = dirname;
+	}
+
+	if(!backupFile(origPath, meta.source))
+		return false;
+
+	// every size is known from the filesystem, so the whole table is laid
+	// out first and the entries are streamed in behind it
+	size_t align = meta.align ? meta.align : 64;
+	std::vector<size_t> sizes(files.size());
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		std::error_code ec;
+		sizes[i] = std::filesystem::file_size(files[i], ec);
+		if(ec)
+		{
+			printErr("Cannot read \"%s\"", files[i].c_str());
+			return false;
+		}
+	}
+
+	// a duplicate's row points at the first copy, nothing is written for it
+	std::vector<size_t> dupOf(files.size(), SIZE_MAX);
+	if(opts.dedup)
+		dupOf = findDuplicates(files, sizes);
+	momoLayout l = planMomo(mb, align, sizes, dupOf, meta.entries);
+
+	size_t dups = 0, saved = 0;
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		if(dupOf[i] == SIZE_MAX)
+			continue;
+		printf("-- \"%s\" is the same as \"%s\", sharing its data\n", files[i].c_str(), files[dupOf[i]].c_str());
+		dups++;
+		saved += (sizes[i] + align - 1) / align * align;
+	}
+
+	if(isc)
+		printf("-- Compressing file\n");
+	packWriter f(origPath, isc, opts.copts);
+	if(!f.is_open())
+	{
+		printErr("Cannot write %s", f.error().c_str());
+		return false;
+	}
+	writeMomo(f, l, [&](size_t i) {
+		printf("-- Writing \"%s\"\n", files[i].c_str());
+		printf("   Size: %lu\n", sizes[i]);
+		printf("   Offset: %lu\n", l.offsets[i]);
+		f.copyFile(files[i], sizes[i]);
+	});
+	if(!f.finish() || !f.commit())
+	{
+		printErr("Failed to write %s", f.error().c_str());
+		return false;
+	}
+	if(opts.dedup)
+		printf("-- Dedup: %lu duplicate entries, %lu bytes saved\n", dups, saved);
+	return true;
+}
+
+bool momoUnpack(byteView buffer, const char* dirname, const fileStamp& source, bool isc, taskPool& pool, writeQueue& out)
+{
+	bool mb;
+	std::vector<blockM> blocks;
+	if(!readMomoTable(buffer, mb, blocks))
+	{
+		printErr("Broken MOMO table");
+		return false;
+	}
+	for(size_t i = 0; i < blocks.size(); i++)
+	{
+		if(!buffer.contains(blocks[i].offset, blocks[i].size))
+		{
+			printErr("Entry %lu is out of bounds (offset: %lu, size: %lu)", i, size_t(blocks[i].offset), size_t(blocks[i].size));
+			return false;
+		}
+	}
+
+	if(!std::filesystem::is_directory(dirname))
+	{
+		if(std::filesystem::create_directory(dirname))
+		{
+			printf("-- Directory \"%s\" created\n", dirname);
+		}
+	}
+
+	size_t bsize = blocks.size();
+
+
+	metaInfo meta;
+	meta.basename = source.name;
+	meta.compressed = isc;
+	meta.type = momo;
+	meta.layout = mb ? "mini" : "block";
+	meta.align = 64;
+	meta.source = source;
+	
+	// entries run as tasks, each fills its own slot so .metadata keeps
+	// the table order
+	std::vector<fileStamp> stamps(bsize);
+	std::atomic<bool> ok{true};
+	taskGroup group;
+	for(size_t i = 0; i < bsize; i++)
+	{
+		size_t o = blocks[i].offset;
+		size_t s = blocks[i].size;
+		pool.submit(group, [buffer, &stamps, &ok, &pool, &out, dirname, i, o, s] {
+			char* ufn = new char[6 + strlen(dirname) + 1 + 3 + 20];
+			// nested parsers get a view into the parent, the only copy
+			// is the decompressed one for compressed entries
+			byteView raw = buffer.sub(o, s);
+			byteView entry = raw;
+			fileType ft = findFileType(entry);
+
+			sprintf(ufn, "%s/id%lu.%s", dirname, i, fileTypeExt(ft));
+			printf("-- Writing to \"%s\", offset: %lu, size: %lu\n", ufn, o, s);
+			out.push(ufn, raw);
+
+			std::filesystem::path ap = std::filesystem::absolute(ufn);
+			std::filesystem::path bn = ap.filename();
+			std::filesystem::path dn = ap.parent_path() / ("_" + bn.string());
+			stamps[i] = stampOf(bn.string(), raw);
+			stamps[i].offset = o;
+			stamps[i].placed = true;
+
+
+			bool done = true;
+			switch (ft) {
+				case momo:
+					done = momoUnpack(entry, dn.string().c_str(), stamps[i], entry.data != raw.data, pool, out);
+					break;
+				case ptx:
+					done = ptxUnpack(entry, dn.string().c_str(), stamps[i], entry.data != raw.data, pool, out);
+					break;
+				case tim2:
+					done = tim2Unpack(entry, dn.string().c_str(), stamps[i], entry.data != raw.data, out);
+					break;
+				case ipu:
+					done = ipumUnpack(entry, dn.string().c_str(), stamps[i], entry.data != raw.data, out);
+					break;
+				default:
+					break;
+			}
+			if(!done)
+				ok = false;
+
+			delete [] ufn;
+		});
+	}
+	pool.wait(group);
+	meta.entries = std::move(stamps);
+	queueMetadata(out, dirname, meta);
+	return ok;
+}
+
+// "id3.tm2", "id3" or "3" to 3, SIZE_MAX if it's none of these
+size_t entryIndex(const char* name)
+{
+	const char* p = name;
+	if(strncmp(p, "id", 2) == 0)
+		p += 2;
+	char* end;
+	unsigned long i = strtoul(p, &end, 10);
+	if(end == p || (*end != '\0' && *end != '.'))
+		return SIZE_MAX;
+	return i;
+}
+
+// -x: follows entryPath ("id3/id1/id0.tm2", components as entryIndex()
+// takes them) down from archive, decompressing only the archives on the way.
+// Writes the entry as extracting would, or with dds the texture inside it,
+// to outPath ("-" is stdout, default the entry's name).
+bool extractEntry(const char* archive, const char* entryPath, const char* outPath, bool dds)
+{
+	bool toStdout = outPath && strcmp(outPath, "-") == 0;
+	// nothing but the entry goes to stdout then
+	auto fail = [&](const std::string& msg) {
+		if(toStdout)
+			fprintf(stderr, "%s\n", msg.c_str());
+		else
+			printErr("%s", msg.c_str());
+	};
+
+	inputFile in;
+	if(!in.open(archive, true))
+	{
+		fail(std::string("Cannot open \"") + archive + "\"");
+		return false;
+	}
+	byteView cur = in.view();
+	std::string name = std::filesystem::path(archive).filename().string();
+
+	std::stringstream path(entryPath);
+	std::string part;
+	while(std::getline(path, part, '/'))
+	{
+		if(part.empty())
+			continue;
+		byteView data = cur;
+		fileType ft = findFileType(data);
+		size_t i = entryIndex(part.c_str());
+		if(i == SIZE_MAX || !archiveEntry(data, ft, i, cur))
+		{
+			fail("No entry \"" + part + "\" in \"" + name + "\"");
+			return false;
+		}
+		name = "id" + std::to_string(i) + "." + fileTypeExt(probeFileType(cur.data, cur.size, cur.size).type);
+	}
+
+	if(dds)
+	{
+		byteView tim = cur;
+		size_t pos;
+		if(findFileType(tim) != tim2 || !tim2Texture(tim, cur, pos))
+		{
+			fail("\"" + name + "\" is not a TIM2 texture");
+			return false;
+		}
+		name += ".dds";
+	}
+
+	if(toStdout)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		if(fwrite(cur.data, 1, cur.size, stdout) != cur.size || fflush(stdout) != 0)
+		{
+			fail("Cannot write the entry to stdout");
+			return false;
+		}
+		return true;
+	}
+	std::string target = outPath ? outPath : name;
+	std::ofstream f(target, std::ios::binary);
+	f.write(cur.data, cur.size);
+	if(!f.good())
+	{
+		fail("Cannot write \"" + target + "\"");
+		return false;
+	}
+	printf("-- Wrote \"%s\" (%lu bytes)\n", target.c_str(), cur.size);
+	return true;
+}
+
+// Replaces one entry of a MOMO with the contents of file. When the archive
+// is uncompressed and the new data fits the entry's slot (up to the next
+// entry) only the slot and its table row are written. Otherwise the
+// archive is rebuilt with the following entries moved.
+bool momoPatch(const char* path, const char* entry, const char* file, const packOptions& opts)
+{
+	std::ifstream nf(file, std::ios::binary | std::ios::ate);
+	if(!nf.is_open())
+	{
+		printErr("Cannot open \"%s\"", file);
+		return false;
+	}
+	std::vector<char> data(nf.tellg());
+	nf.seekg(0, std::ios::beg);
+	nf.read(data.data(), data.size());
+	nf.close();
+
+	// a rebuilt archive is written aside and moved in after the backup
+	std::unique_ptr<packWriter> rebuilt;
+	bool isc, mb;
+	std::vector<blockM> rows;
+	size_t i = entryIndex(entry);
+	size_t o, slotEnd;
+	{
+		inputFile in;
+		if(!in.open(path, true))
+		{
+			printErr("Cannot open \"%s\"", path);
+			return false;
+		}
+		byteView buf = in.view();
+		if(findFileType(buf) != momo)
+		{
+			printErr("--patch works on MOMO archives only");
+			return false;
+		}
+		isc = buf.data != in.view().data;
+		if(!readMomoTable(buf, mb, rows))
+		{
+			printErr("Broken MOMO table");
+			return false;
+		}
+		if(i >= rows.size())
+		{
+			printErr("No entry \"%s\" (archive has %lu)", entry, rows.size());
+			return false;
+		}
+
+		// the slot runs to the next entry; one shared with another row
+		// (dedup) can't be written over
+		o = rows[i].offset;
+		slotEnd = buf.size;
+		bool shared = false;
+		for(size_t j = 0; j < rows.size(); j++)
+		{
+			if(j == i)
+				continue;
+			if(rows[j].offset > o)
+				slotEnd = std::min<size_t>(slotEnd, rows[j].offset);
+			if(rows[j].offset <= o && o < rows[j].offset + std::max<uint64_t>(rows[j].size, 1))
+				shared = true;
+		}
+
+		bool fits = !isc && !shared && o <= slotEnd && data.size() <= slotEnd - o && (!mb || data.size() <= UINT32_MAX);
+		if(!fits)
+		{
+			if(isc)
+				printf("-- Archive is compressed, rebuilding it\n");
+			else if(shared)
+				printf("-- Entry shares its data with another one, rebuilding the archive\n");
+			else
+				printf("-- %lu bytes don't fit the %lu byte slot, rebuilding the archive\n", data.size(), slotEnd - o);
+
+			// laid out like momoPack does it, rows that shared data still
+			// do and the rest keep their offsets if they can
+			std::vector<size_t> sizes(rows.size());
+			std::vector<size_t> dupOf(rows.size(), SIZE_MAX);
+			std::vector<fileStamp> recorded(rows.size());
+			for(size_t j = 0; j < rows.size(); j++)
+			{
+				sizes[j] = j == i ? data.size() : rows[j].size;
+				recorded[j].offset = rows[j].offset;
+				recorded[j].placed = true;
+				if(j == i)
+					continue;
+				if(!buf.contains(rows[j].offset, rows[j].size))
+				{
+					printErr("Entry %lu is out of bounds", j);
+					return false;
+				}
+				for(size_t k = 0; k < j && dupOf[j] == SIZE_MAX; k++)
+					if(k != i && rows[k].offset == rows[j].offset && rows[k].size == rows[j].size)
+						dupOf[j] = k;
+			}
+			momoLayout l = planMomo(mb, 64, sizes, dupOf, recorded);
+
+			rebuilt.reset(new packWriter(path, isc, opts.copts));
+			packWriter& f = *rebuilt;
+			writeMomo(f, l, [&](size_t j) {
+				byteView payload = j == i ? byteView(data) : buf.sub(rows[j].offset, rows[j].size);
+				f.write(payload.data, payload.size);
+			});
+			if(!f.finish())
+			{
+				printErr("Failed to write %s", f.error().c_str());
+				return false;
+			}
+		}
+	}
+
+	if(!backupFile(path))
+		return false;
+
+	if(rebuilt)
+	{
+		if(!rebuilt->commit())
+		{
+			printErr("Cannot replace %s", rebuilt->error().c_str());
+			return false;
+		}
+		printf("-- Wrote \"%s\" (%lu bytes)\n", path, rebuilt->size());
+		return true;
+	}
+
+	// in place: new data, zeros over what is left of the old one, new size
+	std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+	f.seekp(o);
+	f.write(data.data(), data.size());
+	size_t clearEnd = std::min(slotEnd, o + ((std::max<size_t>(data.size(), rows[i].size) + 63) & ~size_t(63)));
+	if(clearEnd > o + data.size())
+	{
+		std::vector<char> zeros(clearEnd - o - data.size(), 0);
+		f.write(zeros.data(), zeros.size());
+	}
+	size_t bcount = mb ? sizeof(uint32_t) : sizeof(uint64_t);
+	size_t ns = data.size();
+	f.seekp((bcount * 2) + (bcount * 2) * i + bcount);
+	f.write(reinterpret_cast<char*>(&ns), bcount);
+	if(!f.good())
+	{
+		printErr("Failed to write \"%s\"", path);
+		return false;
+	}
+	printf("-- Patched entry %lu in place (%lu bytes at offset %lu)\n", i, data.size(), o);
+	return true;
+}
+
+// A file matches its stamp when size and mtime are unchanged, or when
+// only the mtime moved but the contents hash the same
+bool stampClean(const std::filesystem::path& path, const fileStamp& st)
+{
+	if(!st.known)
+		return false;
+	std::error_code ec;
+	if(std::filesystem::file_size(path, ec) != st.size || ec)
+		return false;
+	if(fileTime(path) == st.mtime)
+		return true;
+	uint64_t hash;
+	size_t size;
+	return hashFile(path.string(), hash, size) && hash == st.hash;
+}
+
+// Nothing in dir or under it was touched since unpack (or the last
+// incremental pack), so its archive would come out the same
+bool dirClean(const std::filesystem::path& dir, const metaInfo& m)
+{
+	for(const fileStamp& e : m.entries)
+		if(!stampClean(dir / e.name, e))
+			return false;
+	for(const fileStamp& e : m.parts)
+		if(!stampClean(dir / e.name, e))
+			return false;
+	for(const fileStamp& e : m.entries)
+	{
+		std::filesystem::path sub = dir / ("_" + e.name);
+		metaInfo sm;
+		if(std::filesystem::is_directory(sub) && (!readMetadata((sub / ".metadata").string(), sm) || !dirClean(sub, sm)))
+			return false;
+	}
+	return true;
+}
+
+// Re-stamps what a pack changed so the next incremental pack starts clean
+void restamp(const std::filesystem::path& path, fileStamp& st)
+{
+	if(st.known && stampClean(path, st))
+	{
+		st.mtime = fileTime(path);
+		return;
+	}
+	st.known = hashFile(path.string(), st.hash, st.size);
+	st.mtime = fileTime(path);
+}
+
+bool pack(const char* dirname, const packOptions& opts)
+{
+	if(!std::filesystem::is_directory(dirname))
+	{
+		printErr("Directory not exists");
+		return false;
+	}
+
+	std::filesystem::path _dname = std::filesystem::absolute(dirname);
+	_dname = std::filesystem::canonical(_dname);
+
+	std::filesystem::path _metadataFile = _dname;
+	_metadataFile = _metadataFile.append(".metadata");
+	if(!std::filesystem::exists(_metadataFile))
+	{
+		printErr("Metadata file not exists");
+		return false;
+	}
+	metaInfo meta;
+	if(!readMetadata(_metadataFile.string(), meta))
+	{
+		printErr("\"%s\" is broken or from a newer version", _metadataFile.string().c_str());
+		return false;
+	}
+	std::string basename = meta.basename;
+	std::filesystem::path filePath = _dname.parent_path();
+	filePath = filePath.append(basename);
+
+	if(opts.incremental && stampClean(filePath, meta.source) && dirClean(_dname, meta))
+	{
+		printf("-- \"%s\" is unchanged, skipped\n", basename.c_str());
+		return true;
+	}
+
+	// the type comes from .metadata, only older ones need the original read
+	fileType ft = meta.type;
+	if(ft == unk)
+		ft = findFileType(filePath.string().c_str());
+	printf("-- Packing file \"%s\"\n", basename.c_str());
+	printf("-- File type: %s\n", fileTypeExt(ft));
+	bool ok = false;
+	switch (ft) {
+		case momo:
+			ok = momoPack(_dname.string(), _metadataFile.string(), filePath.string(), opts);
+			break;
+		case ptx:
+			ok = ptxPack(_dname.string(), _metadataFile.string(), filePath.string(), opts);
+			break;
+		case tim2:
+			ok = tim2Pack(_dname.string(), _metadataFile.string(), filePath.string(), opts);
+			break;
+		case ipu:
+			ok = ipumPack(_dname.string(), _metadataFile.string(), filePath.string(), opts);
+			break;
+		default:
+			printErr("Unknown file type");
+			return false;
+	}
+	if(!ok)
+		return false;
+
+	if(opts.incremental)
+	{
+		// rebuilt archives and edited files get new stamps
+		meta.source.name = basename;
+		restamp(filePath, meta.source);
+		for(fileStamp& e : meta.entries)
+			restamp(_dname / e.name, e);
+		for(fileStamp& e : meta.parts)
+			restamp(_dname / e.name, e);
+		std::ofstream m(_metadataFile);
+		m << formatMetadata(meta);
+	}
+	return true;
+}
+
+bool unpack(const char* filename, taskPool& pool, bool map)
+{
+	if(!std::filesystem::exists(filename) || std::filesystem::is_directory(filename))
+	{
+		printErr("File not exists");
+		return false;
+	}
+
+	inputFile f;
+	if(!f.open(filename, map))
+	{
+		printErr("Failed to open file");
+		return false;
+	}
+
+	byteView buff = f.view();
+	size_t fsize = buff.size;
+
+	if (fsize < 16){
+		printErr("Wrong file?");
+		return false;
+	}
+
+	typeProbe probe;
+	fileType ft = findFileType(buff, &probe);
+
+	bool isCompressed = buff.data != f.view().data;
+	printf("-- File size: %lu\n", fsize);
+	if(isCompressed)
+		printf("-- Decompressed size: %lu\n", buff.size);
+	printf("-- File type: %s\n", fileTypeExt(ft));
+	if(!probe.layout.empty())
+		printf("-- Layout: %s\n", probe.layout.c_str());
+
+	std::filesystem::path ap = std::filesystem::absolute(filename);
+	std::filesystem::path basename = ap.filename();
+        std::filesystem::path dirname = ap.parent_path() / ("_" + basename.string());
+
+	// Hashing the whole input up front would read (or with --mmap, fault
+	// in) all of it before the first entry, so it runs beside extraction
+	fileStamp source;
+	source.name = basename.string();
+	source.size = f.view().size;
+	source.known = true;
+	byteView whole = f.view();
+	source.pendingHash = std::async(std::launch::async, [whole] { return hashBytes(whole); }).share();
+
+	// views into f go to the writer, it has to finish before f goes away
+	writeQueue out;
+	bool ok = true;
+	switch (ft) {
+		case momo:
+			ok = momoUnpack(buff, dirname.string().c_str(), source, isCompressed, pool, out);
+			break;
+		case ptx:
+			ok = ptxUnpack(buff, dirname.string().c_str(), source, isCompressed, pool, out);
+			break;
+		case tim2:
+			ok = tim2Unpack(buff, dirname.string().c_str(), source, isCompressed, out);
+			break;
+		case ipu:
+			ok = ipumUnpack(buff, dirname.string().c_str(), source, isCompressed, out);
+			break;
+		default:
+			printErr("Unknown file type");
+			ok = false;
+	}
+
+	if(!out.finish())
+	{
+		printErr("Failed to write %s", out.error().c_str());
+		return false;
+	}
+	return ok;
+}
+
+// One archive or entry in a -l listing. offset is where it sits in its
+// parent's (decompressed) data.
+struct listRow
+{
+	int depth;
+	std::string path;
+	fileType type;
+	bool compressed;
+	size_t offset;
+	size_t size;
+	std::string info;
+	uint64_t hash = 0;
+};
+
+// The decompressed start of raw, enough for the headers of leaf entries
+byteView headOf(byteView raw, const typeProbe& p)
+{
+	if(!p.compressed)
+		return raw;
+	auto head = std::make_shared<std::vector<char>>(SNIFF_SIZE);
+	decompressStream ds(reinterpret_cast<const int16_t*>(raw.data), raw.size);
+	head->resize(ds.read(reinterpret_cast<int16_t*>(head->data()), SNIFF_SIZE / sizeof(int16_t)) * sizeof(int16_t));
+	return byteView(std::shared_ptr<const std::vector<char>>(std::move(head)));
+}
+
+// Walks raw the way unpack() would without writing anything. Only MOMO and
+// PTX are decompressed in full when compressed, to get at their entries;
+// TIM2 and IPU are described from their headers.
+void listEntries(byteView raw, const typeProbe& p, const std::string& path, size_t offset, int depth, std::vector<listRow>& rows, bool hash = false)
+{
+	size_t at = rows.size();
+	rows.push_back({depth, path, p.type, p.compressed, offset, raw.size, ""});
+	if(hash)
+		rows[at].hash = hashBytes(raw);
+	char info[128] = "";
+
+	if(p.type == tim2)
+	{
+		byteReader f(headOf(raw, p));
+		Tim2Header t2header;
+		Tim2PicHeader t2pic;
+		f.read(t2header);
+		if(t2header.formatId != 0x0)
+			f.seek(0x80);
+		f.read(t2pic);
+		f.skip(t2pic.headerSize - sizeof(t2pic));
+		byteView tex = f.take(std::min<size_t>(4, f.remaining()));
+		if(f.failed)
+			snprintf(info, sizeof(info), "broken header");
+		else
+			snprintf(info, sizeof(info), "%ux%u, %u byte %s", t2pic.ImageWidth, t2pic.ImageHeight, t2pic.imgSize,
+				tex.size == 4 && memcmp(tex.data, "DDS ", 4) == 0 ? "DDS" : "PS2 texture");
+	}
+	else if(p.type == ipu)
+	{
+		byteReader f(headOf(raw, p));
+		ipumHeader h;
+		if(f.read(h))
+			snprintf(info, sizeof(info), "%u frames, %u fps", h.frameCount, h.framerate);
+		else
+			snprintf(info, sizeof(info), "broken header");
+	}
+	else if(p.type == momo || p.type == ptx)
+	{
+		byteView data = raw;
+		if(p.compressed && findFileType(data) == unk)
+		{
+			rows[at].info = "doesn't decompress";
+			return;
+		}
+
+		std::vector<blockM> children;
+		bool mb = false;
+		if(p.type == momo)
+		{
+			if(!readMomoTable(data, mb, children))
+			{
+				rows[at].info = "broken table";
+				return;
+			}
+		}
+		else if(!readPtxTable(data, children))
+		{
+			rows[at].info = "broken table";
+			return;
+		}
+
+		int n = snprintf(info, sizeof(info), "%s%lu entries", p.type == momo ? (mb ? "mini table, " : "block table, ") : "", children.size());
+		if(p.compressed)
+			snprintf(info + n, sizeof(info) - n, ", %lu bytes decompressed", data.size);
+		rows[at].info = info;
+
+		for(size_t i = 0; i < children.size(); i++)
+		{
+			size_t o = children[i].offset, sz = children[i].size;
+			// a short last PTX entry lists what is there
+			if(o > data.size)
+				o = data.size;
+			byteView c = data.sub(o, std::min<size_t>(sz, data.size - o));
+			typeProbe cp = probeFileType(c.data, c.size, c.size);
+			std::string name = "id" + std::to_string(i) + "." + fileTypeExt(cp.type);
+			listEntries(c, cp, path + "/" + name, children[i].offset, depth + 1, rows, hash);
+		}
+		return;
+	}
+	rows[at].info = info;
+}
+
+std::string jsonString(const std::string& v)
+{
+	std::string out = "\"";
+	for(char c : v)
+	{
+		if(c == '"' || c == '\\')
+			out += '\\';
+		if(uint8_t(c) < 0x20)
+		{
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out += esc;
+			continue;
+		}
+		out += c;
+	}
+	return out + '"';
+}
+
+// -l: every archive, entry and nested entry of the inputs, as an indented
+// tree or (json) one array of objects
+bool listFiles(const std::vector<std::string>& inputs, bool json)
+{
+	std::vector<listRow> rows;
+	bool ok = true;
+	for(const std::string& input : inputs)
+	{
+		inputFile f;
+		if(!f.open(input.c_str(), true))
+		{
+			if(!json)
+				printErr("Failed to open \"%s\"", input.c_str());
+			ok = false;
+			continue;
+		}
+		byteView v = f.view();
+		// rows keep no views, f can go after this
+		listEntries(v, probeFileType(v.data, v.size, v.size), input, 0, 0, rows);
+	}
+
+	if(json)
+	{
+		printf("[");
+		for(size_t i = 0; i < rows.size(); i++)
+		{
+			const listRow& r = rows[i];
+			printf("%s\n  {\"path\": %s, \"depth\": %d, \"type\": \"%s\", \"compressed\": %s, \"offset\": %lu, \"size\": %lu, \"info\": %s}",
+				i ? "," : "", jsonString(r.path).c_str(), r.depth, fileTypeExt(r.type), r.compressed ? "true" : "false", r.offset, r.size, jsonString(r.info).c_str());
+		}
+		printf("\n]\n");
+		return ok;
+	}
+
+	size_t width = 4;
+	for(const listRow& r : rows)
+		width = std::max(width, r.depth ? r.depth * 2 + r.path.size() - r.path.find_last_of('/') - 1 : r.path.size());
+	printf("%-*s %-4s %10s %10s  %s\n", int(width), "name", "type", "offset", "size", "info");
+	for(const listRow& r : rows)
+	{
+		std::string name = r.depth ? std::string(r.depth * 2, ' ') + r.path.substr(r.path.find_last_of('/') + 1) : r.path;
+		printf("%-*s %-4s %10lu %10lu  %s%s\n", int(width), name.c_str(), fileTypeExt(r.type), r.offset, r.size,
+			r.compressed ? "compressed, " : "", r.info.c_str());
+	}
+	return ok;
+}
+
+bool doSomethingWithFile(const char* input, bool isP, const packOptions& opts, bool map)
+{
+	if(!isP)
+	{
+		taskPool pool(opts.copts.threads);
+		return unpack(input, pool, map);
+	}
+	else
+		return pack(input, opts);
+
+}
+
+// * and ? against a file name
+bool wildcardMatch(const char* p, const char* n)
+{
+	if(*p == '\0')
+		return *n == '\0';
+	if(*p == '*')
+		return wildcardMatch(p + 1, n) || (*n != '\0' && wildcardMatch(p, n + 1));
+	if(*n != '\0' && (*p == '?' || *p == *n))
+		return wildcardMatch(p + 1, n + 1);
+	return false;
+}
+
+// Backups, metadata and the like that sit next to archives
+bool isRepackFile(const std::filesystem::path& p)
+{
+	std::string n = p.filename().string();
+	auto ends = [&](const char* e) { size_t l = strlen(e); return n.size() >= l && n.compare(n.size() - l, l, e) == 0; };
+	return n == ".metadata" || n == INDEX_NAME || ends(".bak") || ends(".bak.sum");
 }
 
-void ptxUnpack(std::vector<char>& buffer, const char* dirname, std::filesystem::path basename, bool isc)
+// Adds what arg names to inputs: archives when extracting, unpacked
+// directories (with .metadata) when packing. Directories are searched
+// without going into the "_name" ones extracting made, those are packed
+// through their parent.
+void collectInputs(const std::string& arg, bool isP, std::vector<std::string>& inputs)
 {
-	std::istringstream f(std::string(buffer.begin(), buffer.end()), std::ios::binary);
-	f.seekg(0, std::ios::beg);
-	uint32_t count;
-	f.read(reinterpret_cast<char*>(&count), sizeof(uint32_t));
-	std::vector<uint32_t> align; // tim2 size / 2048
-	for(size_t i = 0; i < count; i++)
+	namespace fs = std::filesystem;
+	if(arg.size() > 1 && arg[0] == '@')
 	{
-		uint32_t _tu;
-		f.read(reinterpret_cast<char*>(&_tu), sizeof(uint32_t));
-		align.push_back(_tu);
+		std::ifstream list(arg.substr(1));
+		if(!list.is_open())
+		{
+			printErr("Cannot open list \"%s\"", arg.c_str() + 1);
+			return;
+		}
+		std::string line;
+		while(std::getline(list, line))
+		{
+			if(!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if(!line.empty())
+				collectInputs(line, isP, inputs);
+		}
+		return;
 	}
-	f.seekg(0x800, std::ios::beg);	
-	if(!std::filesystem::is_directory(dirname))
+
+	fs::path p = arg;
+	std::string name = p.filename().string();
+	if(name.find_first_of("*?") != std::string::npos)
 	{
-		if(std::filesystem::create_directory(dirname))
+		fs::path dir = p.has_parent_path() ? p.parent_path() : fs::path(".");
+		std::vector<std::string> found;
+		std::error_code ec;
+		for(const fs::directory_entry& e : fs::directory_iterator(dir, ec))
 		{
-			printf("-- Directory \"%s\" created\n", dirname);
+			std::string n = e.path().filename().string();
+			if(!wildcardMatch(name.c_str(), n.c_str()) || isRepackFile(e.path()))
+				continue;
+			// "*.tm2" shouldn't pick up what extracting a .tm2 left
+			if(!isP && e.is_directory() && n.rfind("_", 0) == 0)
+				continue;
+			found.push_back(e.path().string());
 		}
+		if(found.empty())
+			printErr("Nothing matches \"%s\"", arg.c_str());
+		std::sort(found.begin(), found.end());
+		for(const std::string& f : found)
+			collectInputs(f, isP, inputs);
+		return;
 	}
 
+	if(!fs::is_directory(p))
+	{
+		// packing an archive means packing what it was extracted to
+		fs::path unpacked = p.parent_path() / ("_" + name);
+		if(!isP)
+			inputs.push_back(arg);
+		else if(fs::exists(unpacked / ".metadata"))
+			inputs.push_back(unpacked.string());
+		else
+			printErr("\"%s\" is not a directory", arg.c_str());
+		return;
+	}
+	if(isP && fs::exists(p / ".metadata"))
+	{
+		inputs.push_back(arg);
+		return;
+	}
 
-	// sprintf(tc, "%s/.metadata", dirname);
-	std::filesystem::path tc = dirname;
-	tc = tc.append(".metadata");
-	std::vector<std::string> metadataBuffer;
-	metadataBuffer.push_back(basename.string());
-	if(isc)
-		metadataBuffer.push_back("_compressed");
-
-	for(size_t i = 0; i < count; i++)
+	std::vector<std::string> found;
+	std::error_code ec;
+	for(auto it = fs::recursive_directory_iterator(p, ec); it != fs::recursive_directory_iterator(); it.increment(ec))
 	{
-		size_t s = align[i] * 2048;
-		char* ufn = new char[6 + strlen(dirname) + 1 + 3];
-		std::vector<char> buff(s);
-		// f.seekg(o, std::ios::beg);
-		f.read(buff.data(), buff.size());
-
-		fileType ft = findFileType(buff, buff.size());
-
-		sprintf(ufn, "%s/id%lu.%s", dirname, i, fileTypeExt(ft));
-		printf("-- Writing to \"%s\", size: %lu\n", ufn, s);
-
-		std::ofstream uf(ufn, std::ios::binary);
-		uf.write(buff.data(), s);
-		uf.close();
-
-		std::filesystem::path ap = std::filesystem::absolute(ufn);
-		std::filesystem::path bn = ap.filename();
-		std::filesystem::path dn = ap.parent_path() / ("_" + bn.string());
-		
-		switch (ft) {
-			case tim2:
-				tim2Unpack(buff, dn.string().c_str(), bn, false);
-				break;
-			default:
-				break;
+		if(ec)
+			break;
+		bool unpacked = it->path().filename().string().rfind("_", 0) == 0;
+		if(it->is_directory())
+		{
+			if(!unpacked)
+				continue;
+			if(isP && fs::exists(it->path() / ".metadata"))
+				found.push_back(it->path().string());
+			it.disable_recursion_pending();
 		}
-		buff.clear();
-
-		std::filesystem::path _t = std::filesystem::absolute(ufn).filename();
-		metadataBuffer.push_back(_t.string());
-		delete [] ufn;
+		else if(!isP && it->is_regular_file() && !isRepackFile(it->path()))
+			found.push_back(it->path().string());
 	}
-	printf("-- Creating \"%s/.metadata\" file\n", dirname);
-	std::ofstream metadata(tc, std::ios::out);
-	for(const auto e : metadataBuffer)
+	std::sort(found.begin(), found.end());
+	inputs.insert(inputs.end(), found.begin(), found.end());
+}
+
+// Many inputs at once. Files run side by side on one pool, together with
+// the entries they extract; each compresses on a single thread since the
+// pool already keeps the cores busy.
+// A failed input is skipped and the rest carry on, the failed ones are
+// listed at the end. Returns whether all of them went through.
+bool doSomethingWithFiles(const std::vector<std::string>& inputs, bool isP, const packOptions& opts, bool map)
+{
+	if(inputs.size() == 1)
 	{
-		metadata << e << '\n';
+		printf("-- Input file: '%s'\n", inputs[0].c_str());
+		return doSomethingWithFile(inputs[0].c_str(), isP, opts, map);
 	}
 
-	metadata.close();
+	taskPool pool(opts.copts.threads);
+	packOptions fileOpts = opts;
+	if(opts.copts.threads > 1)
+		fileOpts.copts.threads = 1;
+	taskGroup group;
+	std::vector<char> failed(inputs.size(), 0);
+	for(size_t i = 0; i < inputs.size(); i++)
+	{
+		pool.submit(group, [&, i] {
+			printf("-- Input file: '%s'\n", inputs[i].c_str());
+			if(isP)
+				failed[i] = !pack(inputs[i].c_str(), fileOpts);
+			else
+				failed[i] = !unpack(inputs[i].c_str(), pool, map);
+		});
+	}
+	pool.wait(group);
+
+	size_t nfailed = std::count(failed.begin(), failed.end(), 1);
+	printf("-- %lu inputs done\n", inputs.size() - nfailed);
+	if(nfailed == 0)
+		return true;
+	printErr("%lu inputs failed:", nfailed);
+	for(size_t i = 0; i < inputs.size(); i++)
+		if(failed[i])
+			printf("   %s\n", inputs[i].c_str());
+	return false;
 }
 
+// Index of every entry under a data directory, written there as
+// INDEX_NAME and read back through a mapping:
+//   indexHeader, indexSource[sources], indexEntry[entries],
+//   uint32_t[buckets] (entry + 1 by path hash, linear probing, 0 is empty),
+//   then the path strings.
+// Paths are relative to the directory, '/' separated, e.g.
+// "pl.bin/id1.ptx/id0.tm2". An archive's entries follow it in -l order.
+#define INDEX_MAGIC "RPIX"
+#define INDEX_VERSION 1
+
+struct indexHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t sources;
+	uint32_t entries;
+	uint32_t buckets;
+	uint32_t reserved;
+	uint64_t stringsSize;
+};
 
-struct blockM
+// a file the entries came from, as it was when indexed
+struct indexSource
 {
-	uint64_t offset;
+	uint32_t path;
+	uint32_t pathLen;
+	uint32_t first; // its entries
+	uint32_t count;
 	uint64_t size;
+	int64_t mtime;
 };
 
-struct miniBlock
+struct indexEntry
 {
-	uint32_t offset;
-	uint32_t size;
+	uint32_t path;
+	uint32_t pathLen;
+	uint32_t source;
+	int32_t type;
+	uint32_t depth;
+	uint32_t compressed;
+	uint64_t offset; // in the parent's (decompressed) data
+	uint64_t size;
+	uint64_t hash;
 };
 
-void momoPack(std::string dirname, std::string metadataFile, std::string origPath)
+class gameIndex
 {
-	bool mb = false;
-	std::ifstream _m(origPath, std::ios::binary);
-	char c;
-	_m.seekg(sizeof(uint32_t));
-	_m.read(&c, 1);
-	if(c == 'M' || c == 'O')
+public:
+	bool open(const std::string& path)
 	{
-		_m.seekg(sizeof(uint32_t) + 2);
-		_m.read(&c, 1);
+		if(!file.open(path.c_str(), true))
+			return false;
+		byteView v = file.view();
+		if(v.size < sizeof(indexHeader))
+			return false;
+		memcpy(&header, v.data, sizeof(header));
+		if(memcmp(header.magic, INDEX_MAGIC, 4) != 0 || header.version != INDEX_VERSION)
+			return false;
+		size_t sourcesAt = sizeof(indexHeader);
+		size_t entriesAt = sourcesAt + size_t(header.sources) * sizeof(indexSource);
+		size_t bucketsAt = entriesAt + size_t(header.entries) * sizeof(indexEntry);
+		size_t stringsAt = bucketsAt + size_t(header.buckets) * sizeof(uint32_t);
+		if(header.buckets == 0 || (header.buckets & (header.buckets - 1)) != 0 || !v.contains(stringsAt, header.stringsSize))
+			return false;
+		srcs = reinterpret_cast<const indexSource*>(v.data + sourcesAt);
+		ents = reinterpret_cast<const indexEntry*>(v.data + entriesAt);
+		buckets = reinterpret_cast<const uint32_t*>(v.data + bucketsAt);
+		strings = v.sub(stringsAt, header.stringsSize);
+		for(uint32_t i = 0; i < header.sources; i++)
+			if(!strings.contains(srcs[i].path, srcs[i].pathLen) || srcs[i].first > header.entries || srcs[i].count > header.entries - srcs[i].first)
+				return false;
+		for(uint32_t i = 0; i < header.entries; i++)
+			if(!strings.contains(ents[i].path, ents[i].pathLen) || ents[i].source >= header.sources)
+				return false;
+		valid = true;
+		return true;
 	}
-	if(c != 0x0)
-		mb = true;
-	_m.close();
-	
-	bool isc = false;
-	std::ifstream meta(metadataFile);
-	std::string basename;
-	std::string line;
-	std::vector<std::string> files;
-	std::getline(meta, basename);
-	std::filesystem::path _tp = dirname;
-	while(std::getline(meta, line))
+
+	bool ok() const
 	{
-		if(line.find("_compressed") != std::string::npos)
-		{
-			isc = true;
-			continue;
-		}
-		if(line == "") break;
-		std::filesystem::path p = _tp;
-		p.append("_" + line);
-		if(std::filesystem::is_directory(p))
-			pack(p.string().c_str());
-		_tp = _tp.append(line);
-		files.push_back(_tp.string());
-		_tp = dirname;
+		return valid;
 	}
-	meta.close();
 
-	char magic[4] = {'M', 'O', 'M', 'O'};
-	std::string fn = origPath + ".bak";
-	if(!std::filesystem::exists(fn))
+	uint32_t sourceCount() const
 	{
-		std::ifstream _fib(origPath, std::ios::binary);
-		std::ofstream _fob(fn, std::ios::binary);
-		_fob << _fib.rdbuf();
-		_fob.close();
-		_fib.close();
+		return valid ? header.sources : 0;
 	}
-	std::ostringstream f(std::ios::binary);
-	size_t lastpos = 0;
-	size_t lastoff = 0;
-	size_t fsize = 0;
 
-	size_t bcount = sizeof(uint64_t);
-	if(mb)
-		bcount = sizeof(uint32_t);
-
-	f.write(magic, 4);
-	if(!mb)
+	const indexSource& source(uint32_t i) const
 	{
-		uint32_t q = 0;
-		f.write(reinterpret_cast<char*>(&q), sizeof(uint32_t));
-	}
-	size_t tmp = files.size();
-	f.write(reinterpret_cast<char*>(&tmp), bcount);
-	char* _tmp = new char[(bcount*2) * files.size() + (bcount*2)];
-	f.write(_tmp, (bcount*2) * files.size());
-	delete [] _tmp;
-	lastpos = f.tellp();
-	if(lastpos % 64 != 0)
-	{
-		size_t old = lastpos;
-		size_t newpos = (old + 63) & ~63;
-		std::string _tmpBuff(newpos - lastpos, '\0');
-		f.write(_tmpBuff.data(), _tmpBuff.size());
-		lastpos = newpos;
-	}	
-	for(size_t i = 0; i < files.size(); i++)
-	{
-		
-		printf("-- Writing \"%s\"\n", files[i].c_str());
-		std::ifstream _t(files[i], std::ios::binary | std::ios::ate);
-		lastoff = lastpos;
-		fsize = _t.tellg();
-		_t.seekg(0, std::ios::beg);
-		printf("   Size: %lu\n", fsize);
-		printf("   Offset: %lu\n", lastoff);
-		f << _t.rdbuf();
-		lastpos = f.tellp();
-		if(lastpos % 64 != 0)
-		{
-			size_t old = lastpos;
-			size_t newpos = (old + 63) & ~63;
-			std::string _tmpBuff(newpos - lastpos, '\0');
-			f.write(_tmpBuff.data(), _tmpBuff.size());
-			lastpos = newpos;
-		}
-		f.seekp((bcount*2) + (bcount * 2) * i);
-		f.write(reinterpret_cast<char*>(&lastoff), bcount);
-		f.write(reinterpret_cast<char*>(&fsize), bcount);
-		f.seekp(lastpos);
-		_t.close();
+		return srcs[i];
 	}
-	lastpos = f.tellp();
 
-	std::vector<char> buff;
-	std::string _buff = f.str();
-	buff.insert(buff.end(), _buff.begin(), _buff.end());
-	std::ofstream __f(origPath + ".bin", std::ios::binary);
-	__f.write(buff.data(), buff.size());
-	__f.close();
-	if(isc)
+	const indexEntry& entry(uint32_t i) const
 	{
-		printf("-- Compressing file\n");
-		size_t _size = buff.size();
-		std::vector<char> out(_size / 2);
-		size_t csize = compress(buff, out);
-		out.resize(csize);
-
-		buff = std::move(out);
+		return ents[i];
 	}
-	std::ofstream _f(origPath, std::ios::binary);
-	_f.write(buff.data(), buff.size());
-	_f.close();
-}
-
-void momoUnpack(std::vector<char>& buffer, const char* dirname, std::filesystem::path basename, bool isc)
-{
-	std::istringstream f(std::string(buffer.begin(), buffer.end()), std::ios::binary);
-
-	std::vector<blockM> blocks;
-	std::vector<miniBlock> mBlocks;
 
-	size_t blocks_count;
-
-	bool mb = false;
-	char c;
-	f.seekg(sizeof(uint32_t));
-	f.read(&c, 1);
-	if (c != 0x0)
-		mb = true;
-
-	if(!mb)
+	std::string pathOf(const indexSource& s) const
 	{
-		f.seekg(sizeof(uint64_t), std::ios::beg);
-		f.read(reinterpret_cast<char*>(&blocks_count), sizeof(uint64_t));
-	}else{
-		f.seekg(sizeof(uint32_t), std::ios::beg);
-		uint32_t tbc;
-		f.read(reinterpret_cast<char*>(&tbc), sizeof(uint32_t));
-		blocks_count = tbc;
+		return std::string(strings.data + s.path, s.pathLen);
 	}
 
-	for(size_t i = 0; i < blocks_count; i++)
+	std::string pathOf(const indexEntry& e) const
 	{
-		if(!mb){
-			blockM block;
-			f.read(reinterpret_cast<char*>(&block), sizeof(block));
-			blocks.push_back(block);
-		}else{	
-			miniBlock mblock;
-			f.read(reinterpret_cast<char*>(&mblock), sizeof(mblock));
-			mBlocks.push_back(mblock);
-		}
+		return std::string(strings.data + e.path, e.pathLen);
 	}
-	f.seekg(0, std::ios::beg);
 
-	if(!std::filesystem::is_directory(dirname))
+	const indexEntry* find(const std::string& path) const
 	{
-		if(std::filesystem::create_directory(dirname))
+		if(!valid)
+			return nullptr;
+		uint32_t mask = header.buckets - 1;
+		uint32_t b = hashBytes(byteView(path.data(), path.size())) & mask;
+		for(uint32_t n = 0; n < header.buckets; n++, b = (b + 1) & mask)
 		{
-			printf("-- Directory \"%s\" created\n", dirname);
+			uint32_t i = buckets[b];
+			if(i == 0 || i > header.entries)
+				return nullptr;
+			const indexEntry& e = ents[i - 1];
+			if(e.pathLen == path.size() && memcmp(strings.data + e.path, path.data(), path.size()) == 0)
+				return &e;
 		}
+		return nullptr;
 	}
 
-	size_t bsize = mb ? mBlocks.size() : blocks.size();
-
-
-	// sprintf(tc, "%s/.metadata", dirname);
-	std::filesystem::path tc = dirname;
-	tc = tc.append(".metadata");
-	std::vector<std::string> metadataBuffer;
-	metadataBuffer.push_back(basename.string());
-	if(isc)
-		metadataBuffer.push_back("_compressed");
-	
-	for(size_t i = 0; i < bsize; i++)
+	// the source is still the size and age it was indexed at
+	bool fresh(const indexSource& s, const std::filesystem::path& root) const
 	{
-		size_t o, s;
-		if(!mb){
-			o = blocks[i].offset;
-			s = blocks[i].size;
-		}else{
-			o = mBlocks[i].offset;
-			s = mBlocks[i].size;
-		}
-
-		char* ufn = new char[6 + strlen(dirname) + 1 + 3];
-		assert(o + s <= buffer.size()); // check if filesize is bigger or equal
-
-		std::vector<char> buff(s);
-		f.seekg(o, std::ios::beg);
-		f.read(buff.data(), s);
-
-		fileType ft = findFileType(buff, buff.size());
+		std::error_code ec;
+		std::filesystem::path p = root / pathOf(s);
+		return std::filesystem::file_size(p, ec) == s.size && !ec && fileTime(p) == s.mtime;
+	}
 
-		sprintf(ufn, "%s/id%lu.%s", dirname, i, fileTypeExt(ft));
-		printf("-- Writing to \"%s\", offset: %lu, size: %lu\n", ufn, o, s);
+private:
+	inputFile file;
+	indexHeader header;
+	const indexSource* srcs = nullptr;
+	const indexEntry* ents = nullptr;
+	const uint32_t* buckets = nullptr;
+	byteView strings;
+	bool valid = false;
+};
 
-		std::ofstream uf(ufn, std::ios::binary);
-		uf.write(buff.data(), s);
-		uf.close();
+// Scans the archives under dir into dir/INDEX_NAME. Ones that kept their
+// size and mtime since the last index are carried over, not reread.
+bool buildIndex(const std::string& dir)
+{
+	namespace fs = std::filesystem;
+	fs::path root = dir;
+	fs::path indexPath = root / INDEX_NAME;
 
-		std::filesystem::path ap = std::filesystem::absolute(ufn);
-		std::filesystem::path bn = ap.filename();
-		std::filesystem::path dn = ap.parent_path() / ("_" + bn.string());
+	std::vector<std::string> files;
+	collectInputs(dir, false, files);
 
+	struct indexedFile
+	{
+		std::string path;
+		size_t size;
+		int64_t mtime;
+		std::vector<listRow> rows;
+	};
+	std::vector<indexedFile> indexed;
+	size_t rescanned = 0;
+	{
+		gameIndex old;
+		old.open(indexPath.string());
+		std::map<std::string, uint32_t> oldSources;
+		for(uint32_t i = 0; i < old.sourceCount(); i++)
+			oldSources[old.pathOf(old.source(i))] = i;
 
-		switch (ft) {
-			case momo:
-				momoUnpack(buff, dn.string().c_str(), bn, false);
-				break;
-			case ptx:
-				ptxUnpack(buff, dn.string().c_str(), bn, false);
-				break;
-			case tim2:
-				tim2Unpack(buff, dn.string().c_str(), bn, false);
-				break;
-			case ipu:
-				ipumUnpack(buff, dn.string().c_str(), bn, false);
-				break;
-			default:
-				break;
+		for(const std::string& f : files)
+		{
+			indexedFile ix;
+			ix.path = fs::path(f).lexically_relative(root).generic_string();
+			std::error_code ec;
+			ix.size = fs::file_size(f, ec);
+			ix.mtime = fileTime(f);
+			if(ec)
+				continue;
+
+			auto it = oldSources.find(ix.path);
+			if(it != oldSources.end() && old.source(it->second).size == ix.size && old.source(it->second).mtime == ix.mtime)
+			{
+				const indexSource& s = old.source(it->second);
+				for(uint32_t i = s.first; i < s.first + s.count; i++)
+				{
+					const indexEntry& e = old.entry(i);
+					ix.rows.push_back({int(e.depth), old.pathOf(e), fileType(e.type), e.compressed != 0, e.offset, e.size, "", e.hash});
+				}
+			}
+			else
+			{
+				inputFile in;
+				if(!in.open(f.c_str(), true))
+					continue;
+				byteView v = in.view();
+				// files that aren't archives are kept as sources without
+				// entries, so they aren't taken for new ones later
+				typeProbe p = probeFileType(v.data, v.size, v.size);
+				if(p.type != unk)
+					listEntries(v, p, ix.path, 0, 0, ix.rows, true);
+				rescanned++;
+			}
+			indexed.push_back(std::move(ix));
 		}
-		buff.clear();
-
-		std::filesystem::path _t = std::filesystem::absolute(ufn).filename();
-		metadataBuffer.push_back(_t.string());
-		delete [] ufn;
 	}
-	printf("-- Creating \"%s/.metadata\" file\n", dirname);
-	std::ofstream metadata(tc, std::ios::out);
-	for(const auto e : metadataBuffer)
+
+	std::vector<indexSource> sources;
+	std::vector<indexEntry> entries;
+	std::string strings;
+	for(const indexedFile& ix : indexed)
 	{
-		metadata << e << '\n';
+		indexSource s = {uint32_t(strings.size()), uint32_t(ix.path.size()), uint32_t(entries.size()), uint32_t(ix.rows.size()), ix.size, ix.mtime};
+		strings += ix.path;
+		for(const listRow& r : ix.rows)
+		{
+			entries.push_back({uint32_t(strings.size()), uint32_t(r.path.size()), uint32_t(sources.size()), int32_t(r.type), uint32_t(r.depth),
+				uint32_t(r.compressed), r.offset, r.size, r.hash});
+			strings += r.path;
+		}
+		sources.push_back(s);
 	}
 
-	metadata.close();
-}
-
-void pack(const char* dirname)
-{
-	if(!std::filesystem::is_directory(dirname))
+	uint32_t bucketCount = 16;
+	while(bucketCount < entries.size() * 2)
+		bucketCount <<= 1;
+	std::vector<uint32_t> buckets(bucketCount, 0);
+	for(uint32_t i = 0; i < entries.size(); i++)
 	{
-		printErr("Directory not exists");
-		return;
+		uint32_t b = hashBytes(byteView(strings.data() + entries[i].path, entries[i].pathLen)) & (bucketCount - 1);
+		while(buckets[b] != 0)
+			b = (b + 1) & (bucketCount - 1);
+		buckets[b] = i + 1;
 	}
 
-	std::filesystem::path _dname = std::filesystem::absolute(dirname);
-	_dname = std::filesystem::canonical(_dname);
-
-	std::filesystem::path _metadataFile = _dname;
-	_metadataFile = _metadataFile.append(".metadata");
-	if(!std::filesystem::exists(_metadataFile))
+	indexHeader h = {};
+	memcpy(h.magic, INDEX_MAGIC, 4);
+	h.version = INDEX_VERSION;
+	h.sources = sources.size();
+	h.entries = entries.size();
+	h.buckets = bucketCount;
+	h.stringsSize = strings.size();
+
+	// written aside and renamed over, something may have the old one mapped
+	fs::path tmp = indexPath;
+	tmp += ".tmp";
 	{
-		printf("-- Metadata file not exists\n");
-		return;
+		std::ofstream out(tmp, std::ios::binary);
+		out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		out.write(reinterpret_cast<const char*>(sources.data()), sources.size() * sizeof(indexSource));
+		out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(indexEntry));
+		out.write(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(uint32_t));
+		out.write(strings.data(), strings.size());
+		if(!out.good())
+		{
+			printErr("Cannot write \"%s\"", tmp.string().c_str());
+			return false;
+		}
 	}
-	std::ifstream meta(_metadataFile.string());
-	std::string basename;
-	std::getline(meta, basename);
-	meta.close();
-	std::filesystem::path filePath = _dname.parent_path();
-	filePath = filePath.append(basename);
-
-	fileType ft = findFileType(filePath.string().c_str());
-	printf("-- Packing file \"%s\"\n", basename.c_str());
-	printf("-- File type: %s\n", fileTypeExt(ft));
-	switch (ft) {
-		case momo:
-			momoPack(_dname.string(), _metadataFile.string(), filePath.string());
-			break;
-		case ptx:
-			ptxPack(_dname.string(), _metadataFile.string(), filePath.string());
-			break;
-		case tim2:
-			tim2Pack(_dname.string(), _metadataFile.string(), filePath.string());
-			break;
-		case ipu:
-			ipumPack(_dname.string(), _metadataFile.string(), filePath.string());
-			break;
-		default:
-			return;
+	std::error_code ec;
+	fs::rename(tmp, indexPath, ec);
+	if(ec)
+	{
+		printErr("Cannot write \"%s\"", indexPath.string().c_str());
+		return false;
 	}
+	printf("-- Indexed %lu entries in %lu files (%lu scanned) to \"%s\"\n", entries.size(), sources.size(), rescanned, indexPath.string().c_str());
+	return true;
 }
 
-void unpack(const char* filename)
+// Whether a file under dir changed, went away or was added since ix was
+// built. New files are found by listing dir again.
+bool indexStale(const gameIndex& ix, const std::string& dir)
 {
-	if(!std::filesystem::exists(filename) || std::filesystem::is_directory(filename))
+	std::filesystem::path root = dir;
+	std::map<std::string, uint32_t> recorded;
+	for(uint32_t i = 0; i < ix.sourceCount(); i++)
 	{
-		printErr("File not exists");
-		return;
+		if(!ix.fresh(ix.source(i), root))
+			return true;
+		recorded[ix.pathOf(ix.source(i))] = i;
 	}
+	std::vector<std::string> files;
+	collectInputs(dir, false, files);
+	for(const std::string& f : files)
+		if(recorded.find(std::filesystem::path(f).lexically_relative(root).generic_string()) == recorded.end())
+			return true;
+	return false;
+}
 
-	std::ifstream f(filename, std::ios::binary);
-
-	if(!f.is_open())
+// repack index <dir> [--find <path>]...
+// Without --find (re)builds the index. Lookups use the index as it is
+// unless the archive they land in changed since, then it is rebuilt first.
+int indexCommand(int argc, char** argv)
+{
+	const char* dir = nullptr;
+	std::vector<const char*> finds;
+	for(int i = 2; i < argc; i++)
 	{
-		printErr("Failed to open file");
-		return;
+		if(strcmp(argv[i], "--find") == 0 && i + 1 < argc)
+			finds.push_back(argv[++i]);
+		else if(argv[i][0] != '-' && !dir)
+			dir = argv[i];
+		else
+		{
+			printUsageError(argv[0], argv[i]);
+			return 1;
+		}
 	}
-
-	f.seekg(0, std::ios::end);
-	size_t fsize = f.tellg();
-	f.seekg(0, std::ios::beg);
-	std::vector<char> buff(fsize);
-	f.read(buff.data(), buff.size());
-	f.close();
-
-	if (fsize < 16){
-		printErr("Wrong file?");
-		exit(-1);
+	if(!dir || !std::filesystem::is_directory(dir))
+	{
+		printErr("index needs a data directory");
+		return 1;
 	}
 
-	fileType ft = findFileType(buff, fsize);
-
-	bool isCompressed = (fsize != buff.size()) ? true : false;
-	printf("-- File size: %lu\n", fsize);
-	if(isCompressed)
-		printf("-- Decompressed size: %lu\n", buff.size());
-	printf("-- File type: %s\n", fileTypeExt(ft));
-
-	std::filesystem::path ap = std::filesystem::absolute(filename);
-	std::filesystem::path basename = ap.filename();
-        std::filesystem::path dirname = ap.parent_path() / ("_" + basename.string());
+	std::filesystem::path root = dir;
+	std::string indexPath = (root / INDEX_NAME).string();
+	if(finds.empty())
+		return buildIndex(dir) ? 0 : 1;
 
-	switch (ft) {
-		case momo:
-			momoUnpack(buff, dirname.string().c_str(), basename, isCompressed);
-			break;
-		case ptx:
-			ptxUnpack(buff, dirname.string().c_str(), basename, isCompressed);
-			break;
-		case tim2:
-			tim2Unpack(buff, dirname.string().c_str(), basename, isCompressed);
-			break;
-		case ipu:
-			ipumUnpack(buff, dirname.string().c_str(), basename, isCompressed);
-			break;
-		default:
-			return;
+	std::unique_ptr<gameIndex> ix(new gameIndex);
+	bool rebuilt = false;
+	if(!ix->open(indexPath))
+	{
+		buildIndex(dir);
+		rebuilt = true;
+		ix.reset(new gameIndex);
+		ix->open(indexPath);
 	}
-
+	bool found = true;
+	for(const char* path : finds)
+	{
+		const indexEntry* e = ix->find(path);
+		bool stale = e && !ix->fresh(ix->source(e->source), root);
+		// a miss could be in a file changed or added since, once a run is
+		// enough for that
+		if(!e && !rebuilt)
+			stale = indexStale(*ix, dir);
+		if(stale)
+		{
+			printf("-- Index is out of date\n");
+			ix.reset(new gameIndex);
+			buildIndex(dir);
+			rebuilt = true;
+			ix->open(indexPath);
+			e = ix->find(path);
+		}
+		if(!e)
+		{
+			printErr("\"%s\" is not in the index", path);
+			found = false;
+			continue;
+		}
+		printf("%s\t%s\t%s\toffset %lu\tsize %lu\thash %s\tin %s\n", path, fileTypeExt(fileType(e->type)), e->compressed ? "compressed" : "plain",
+			size_t(e->offset), size_t(e->size), hashHex(e->hash).c_str(), ix->pathOf(ix->source(e->source)).c_str());
+	}
+	return found ? 0 : 1;
 }
 
-void doSomethingWithFile(const char* input, bool isP)
+// The operand of argv[i], a whole decimal number up to max; i moves past it
+bool parseNumber(int argc, char** argv, int& i, unsigned long max, unsigned long& n)
 {
-	if(!isP)
-		unpack(input);
-	else
-		pack(input);
-
+	if(++i >= argc)
+		return false;
+	const char* a = argv[i];
+	char* end;
+	errno = 0;
+	n = strtoul(a, &end, 10);
+	return *a >= '0' && *a <= '9' && *end == '\0' && errno == 0 && n <= max;
 }
 
 int main(int argc, char** argv)
 {
-	printf("== Shitty repacker from deadYokai ==\n");
+	// --json and -o - output has to be nothing but the JSON or the entry
+	bool json = false, quiet = false;
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--json") == 0)
+			json = quiet = true;
+		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc && strcmp(argv[i + 1], "-") == 0)
+			quiet = true;
+	}
+	if(!quiet)
+		printf("== Shitty repacker from deadYokai ==\n");
 	if(argc <= 1){
 		printHelp(argv[0]);
 		return 0;
 	}
+	if(strcmp(argv[1], "index") == 0)
+		return indexCommand(argc, argv);
 
 	bool isPack = false;
-
-	if(argv[2])
+	int level = CLEVEL_DEFAULT;
+	uint32_t threads = 1;
+	bool map = false;
+	bool incremental = false;
+	bool dedup = false;
+	bool list = false;
+	bool dds = false;
+	const char* xArchive = nullptr;
+	const char* xEntry = nullptr;
+	const char* outPath = nullptr;
+	const char* patchEntry = nullptr;
+	const char* patchFile = nullptr;
+	std::vector<const char*> args;
+
+	for(int i = 1; i < argc; i++)
 	{
-		if(strcmp(argv[2], "-p") == 0 || strcmp(argv[2], "--pack") == 0)
+		if(argv[i][0] != '-')
+			args.push_back(argv[i]);
+		else if(strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pack") == 0)
 			isPack = true;
-		else if(strcmp(argv[2], "-e") == 0 || strcmp(argv[2], "--extract") == 0)
+		else if(strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--extract") == 0)
 			isPack = false;
+		else if(strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0)
+		{
+			unsigned long n;
+			if(!parseNumber(argc, argv, i, JOBS_MAX, n))
+			{
+				printErr("%s takes a thread count, 0-%d", argv[i - 1], JOBS_MAX);
+				return 1;
+			}
+			threads = n;
+			if(threads == 0)
+				threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		else if(strcmp(argv[i], "--mmap") == 0)
+			map = true;
+		else if(strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--incremental") == 0)
+			incremental = true;
+		else if(strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dedup") == 0)
+			dedup = true;
+		else if(strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--list") == 0)
+			list = true;
+		else if(strcmp(argv[i], "--json") == 0)
+			list = true;
+		else if(strcmp(argv[i], "-x") == 0 && i + 2 < argc)
+		{
+			xArchive = argv[++i];
+			xEntry = argv[++i];
+		}
+		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			outPath = argv[++i];
+		else if(strcmp(argv[i], "--dds") == 0)
+			dds = true;
+		else if(strcmp(argv[i], "--patch") == 0 && i + 2 < argc)
+		{
+			patchEntry = argv[++i];
+			patchFile = argv[++i];
+		}
+		else if(strcmp(argv[i], "--level") == 0)
+		{
+			unsigned long n;
+			if(!parseNumber(argc, argv, i, CLEVEL_MAX, n))
+			{
+				printErr("Compression level must be 0-%d", CLEVEL_MAX);
+				return 1;
+			}
+			level = n;
+		}
 		else
 		{
-			printUsageError(argv[0], argv[2]);
-			return 0;
+			printUsageError(argv[0], argv[i]);
+			return 1;
 		}
 	}
 
-	printf("-- Input file: '%s'\n", argv[1]);
-	doSomethingWithFile(argv[1], isPack);
-	return 1;
-}
+	packOptions opts;
+	opts.copts = compressLevel(level);
+	opts.copts.threads = threads;
+	opts.incremental = incremental;
+	opts.dedup = dedup;
+
+	if(xArchive)
+	{
+		return extractEntry(xArchive, xEntry, outPath, dds) ? 0 : 1;
+	}
+	if(patchEntry)
+	{
+		if(args.size() != 1)
+		{
+			printErr("--patch takes exactly one archive");
+			return 1;
+		}
+		printf("-- Input file: '%s'\n", args[0]);
+		return momoPatch(args[0], patchEntry, patchFile, opts) ? 0 : 1;
+	}
 
+	std::vector<std::string> inputs;
+	for(const char* a : args)
+		collectInputs(a, isPack && !list, inputs);
+	if(inputs.empty())
+	{
+		printErr("No input files");
+		return 1;
+	}
+	if(list)
+	{
+		return listFiles(inputs, json) ? 0 : 1;
+	}
+	return doSomethingWithFiles(inputs, isPack, opts, map) ? 0 : 1;
+}